@@ -0,0 +1,57 @@
+/* dazukofs: access control stackable filesystem
+
+   Copyright (C) 2008-2009 John Ogness
+     Author: John Ogness <dazukocode@ogness.net>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <linux/device.h>
+
+#include "dev.h"
+#include "proc_dev.h"
+
+static struct dazukofs_proc_dev async_dev = {
+	.name		= "async",
+	.cache_name	= "dazukofs_async_cache",
+	.by_tgid	= 1,
+};
+
+/**
+ * dazukofs_check_async_process - check if current process is trusted
+ *
+ * Description: This is called for file accesses that need to be checked.
+ * All threads of a process that opened /dev/dazukofs.async are trusted.
+ *
+ * Returns 0 if the current process is trusted.
+ */
+int dazukofs_check_async_process(void)
+{
+	return dazukofs_proc_dev_check(&async_dev);
+}
+
+int dazukofs_async_dev_init(int dev_major, int dev_minor,
+			    struct class *dazukofs_class)
+{
+	return dazukofs_proc_dev_init(&async_dev, dev_major, dev_minor,
+				      dazukofs_class);
+}
+
+void dazukofs_async_dev_destroy(int dev_major, int dev_minor,
+				struct class *dazukofs_class)
+{
+	dazukofs_proc_dev_destroy(&async_dev, dev_major, dev_minor,
+				  dazukofs_class);
+}
@@ -0,0 +1,1073 @@
+/* dazukofs: access control stackable filesystem
+
+   Copyright (C) 2008-2010 John Ogness
+     Author: John Ogness <dazukocode@ogness.net>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/rculist.h>
+
+#include "dazukofs_fs.h"
+#include "cache.h"
+
+/*
+ * The cached verdict of an inode is stored as a single word so that it
+ * can be read without taking any locks. The lower bits hold the verdict,
+ * the upper bits hold the epoch in which the verdict was given.
+ */
+#define VERDICT_BITS	2
+#define VERDICT_MASK	((1UL << VERDICT_BITS) - 1)
+
+/* the epoch is changed whenever cached verdicts become untrustworthy */
+static atomic_long_t cache_epoch = ATOMIC_LONG_INIT(1);
+
+static unsigned long current_epoch(void)
+{
+	return (unsigned long)atomic_long_read(&cache_epoch) &
+	       (~0UL >> VERDICT_BITS);
+}
+
+static void persist_remove(struct inode *inode);
+static void persist_remove_work(struct work_struct *work);
+static void warm_forget(struct inode *inode);
+static void warm_purge(unsigned long epoch);
+
+/**
+ * dazukofs_cache_init_inode - reset the cached verdict of a new inode
+ * @inode: the newly allocated inode
+ *
+ * Description: Inode structures are recycled by the slab allocator, so
+ * the cached verdict (and in-flight event and flags) must be cleared for
+ * every newly allocated inode.
+ */
+void dazukofs_cache_init_inode(struct inode *inode)
+{
+	get_inode_private(inode)->verdict = 0;
+	get_inode_private(inode)->inflight = NULL;
+	get_inode_private(inode)->flags = 0;
+	seqcount_init(&get_inode_private(inode)->verdict_seq);
+	INIT_WORK(&get_inode_private(inode)->persist_work, persist_remove_work);
+}
+
+/**
+ * lower_unchanged - check the lower inode against the cached verdict
+ * @dii: the inode info (read under verdict_seq)
+ *
+ * Description: The lower file may be modified through another mount (or
+ * a file opened before DazukoFS was mounted), which does not invalidate
+ * the cached verdict. The ctime and i_version change with every such
+ * modification.
+ */
+static int lower_unchanged(struct dazukofs_inode_info *dii)
+{
+	struct inode *lower_inode = dii->lower_inode;
+
+	if (!timespec_equal(&lower_inode->i_ctime, &dii->verdict_ctime) ||
+	    i_size_read(lower_inode) != dii->verdict_size)
+		return 0;
+
+	if (IS_I_VERSION(lower_inode) &&
+	    lower_inode->i_version != dii->verdict_version)
+		return 0;
+
+	return 1;
+}
+
+/**
+ * dazukofs_cache_lookup - get the cached verdict of an inode
+ * @inode: the inode being accessed
+ *
+ * Description: This function is called for every file access and does
+ * not take any locks. Only regular files are cached. If the file is
+ * currently mapped shared, its contents may change at any time, so no
+ * cached verdict is trusted. Neither is it if the lower file changed
+ * since the verdict was given.
+ *
+ * Returns the cached verdict or VERDICT_NONE if nothing (valid) is cached.
+ */
+dazukofs_verdict_t dazukofs_cache_lookup(struct inode *inode)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(inode);
+	unsigned long verdict;
+	unsigned int seq;
+	int unchanged;
+
+	if (!S_ISREG(inode->i_mode))
+		return VERDICT_NONE;
+
+	if (mapping_writably_mapped(inode->i_mapping))
+		return VERDICT_NONE;
+
+	do {
+		seq = read_seqcount_begin(&dii->verdict_seq);
+		verdict = dii->verdict;
+		unchanged = lower_unchanged(dii);
+	} while (read_seqcount_retry(&dii->verdict_seq, seq));
+
+	if ((verdict >> VERDICT_BITS) != current_epoch() || !unchanged)
+		return VERDICT_NONE;
+
+	return verdict & VERDICT_MASK;
+}
+
+/**
+ * dazukofs_cache_prepare - remember the inode state before an access check
+ * @inode: the inode being accessed
+ * @ticket: to be filled with the current state
+ *
+ * Description: The ticket is later passed to dazukofs_cache_store(). If the
+ * inode was modified (or the epoch changed) in the meantime, the verdict
+ * will not be cached.
+ */
+void dazukofs_cache_prepare(struct inode *inode,
+			    struct dazukofs_cache_ticket *ticket)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(inode);
+
+	ticket->epoch = current_epoch();
+
+	spin_lock(&dii->verdict_lock);
+	ticket->change_count = dii->change_count;
+	spin_unlock(&dii->verdict_lock);
+
+	ticket->mtime = dii->lower_inode->i_mtime;
+	ticket->ctime = dii->lower_inode->i_ctime;
+	ticket->version = IS_I_VERSION(dii->lower_inode) ?
+			  dii->lower_inode->i_version : 0;
+	ticket->size = i_size_read(dii->lower_inode);
+}
+
+/**
+ * dazukofs_cache_store - cache the verdict for an inode
+ * @inode: the inode that was checked
+ * @ticket: the state of the inode before the check was started
+ * @verdict: the verdict to cache
+ *
+ * Description: The verdict is only stored if the inode was not modified
+ * since the ticket was prepared. The state of the lower inode in the
+ * ticket is kept with the verdict. A remembered deny (of the same epoch) is
+ * not replaced by an allow.
+ */
+void dazukofs_cache_store(struct inode *inode,
+			  struct dazukofs_cache_ticket *ticket,
+			  dazukofs_verdict_t verdict)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(inode);
+	unsigned long new_verdict = (ticket->epoch << VERDICT_BITS) | verdict;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	spin_lock(&dii->verdict_lock);
+	if (dii->change_count == ticket->change_count &&
+	    dii->verdict != ((ticket->epoch << VERDICT_BITS) | VERDICT_DENY)) {
+		write_seqcount_begin(&dii->verdict_seq);
+		dii->verdict = new_verdict;
+		dii->verdict_ctime = ticket->ctime;
+		dii->verdict_version = ticket->version;
+		dii->verdict_size = ticket->size;
+		write_seqcount_end(&dii->verdict_seq);
+	}
+	spin_unlock(&dii->verdict_lock);
+}
+
+/**
+ * dazukofs_cache_invalidate - forget the cached verdict of an inode
+ * @inode: the inode that has been (or may have been) modified
+ *
+ * Description: This function must be called whenever the contents or
+ * attributes of a file change. Any verdict that was in progress while
+ * this function was called will not be cached.
+ */
+void dazukofs_cache_invalidate(struct inode *inode)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(inode);
+
+	spin_lock(&dii->verdict_lock);
+	dii->change_count++;
+	write_seqcount_begin(&dii->verdict_seq);
+	dii->verdict = 0;
+	write_seqcount_end(&dii->verdict_seq);
+	spin_unlock(&dii->verdict_lock);
+
+	/* a stored verdict must not outlive the modification */
+	if (test_and_clear_bit(DAZUKOFS_INODE_PERSISTED, &dii->flags))
+		persist_remove(inode);
+	warm_forget(inode);
+}
+
+/**
+ * dazukofs_cache_new_epoch - invalidate all cached verdicts
+ *
+ * Description: This is called when the set of groups changes. Cached
+ * verdicts are not actively cleared, but are ignored because they belong
+ * to an older epoch.
+ */
+void dazukofs_cache_new_epoch(void)
+{
+	atomic_long_inc(&cache_epoch);
+}
+
+/*
+ * Verdicts can also be stored in an extended attribute of the lower file,
+ * so that they survive module reloads and reboots. A stored verdict is
+ * only trusted if it was stored in the current scanner epoch (supplied by
+ * the application with "persist=N", 0 disables), for the current set of
+ * groups, and the lower file did not change since.
+ *
+ * Users can set the modification time, but not the ctime. Writing the
+ * extended attribute changes the ctime, so the record holds the ctime
+ * produced by its own write. Modifications through DazukoFS also remove
+ * the extended attribute (from a workqueue, since the i_mutex of the
+ * lower inode cannot be taken on all modification paths).
+ */
+#define PERSIST_XATTR	"trusted.dazukofs"
+#define PERSIST_VERSION	2
+
+struct dazukofs_persist_record {
+	__le32 version;
+	__le32 verdict;
+	__le64 epoch;
+	__le64 groups;
+	__le64 mtime_sec;
+	__le64 mtime_nsec;
+	__le64 ctime_sec;
+	__le64 ctime_nsec;
+	__le64 size;
+};
+
+static atomic_long_t persist_epoch = ATOMIC_LONG_INIT(0);
+
+static struct workqueue_struct *persist_wq;
+
+/**
+ * dazukofs_persist_init - initialize stored verdict handling
+ *
+ * Returns 0 on success.
+ */
+int dazukofs_persist_init(void)
+{
+	persist_wq = alloc_workqueue("dazukofs_persist", 0, 0);
+	if (!persist_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * dazukofs_persist_flush - wait for pending removals of stored verdicts
+ *
+ * Description: Pending removals hold inode references, so this must be
+ * called before a DazukoFS superblock is shut down.
+ */
+void dazukofs_persist_flush(void)
+{
+	flush_workqueue(persist_wq);
+}
+
+/**
+ * dazukofs_persist_destroy - cleanup stored verdict handling
+ */
+void dazukofs_persist_destroy(void)
+{
+	destroy_workqueue(persist_wq);
+}
+
+/**
+ * persist_want_write - get write access for changing a stored verdict
+ * @dentry: the dentry of the file
+ *
+ * Description: Stored verdicts are not changed on read-only mounts or on
+ * frozen filesystems (the opener does not wait for them to be thawed).
+ * mnt_want_write() also takes the freeze protection of the lower
+ * filesystem.
+ *
+ * Returns 0 if write access was taken, which must be dropped with
+ * mnt_drop_write() on the lower vfsmount.
+ */
+static int persist_want_write(struct dentry *dentry)
+{
+	struct vfsmount *lower_mnt = get_lower_mnt(dentry);
+
+	if (IS_RDONLY(dentry->d_inode))
+		return -EROFS;
+
+	if (lower_mnt->mnt_sb->s_writers.frozen != SB_UNFROZEN)
+		return -EBUSY;
+
+	return mnt_want_write(lower_mnt);
+}
+
+/**
+ * persist_remove - remove the stored verdict of a modified file
+ * @inode: the modified inode
+ *
+ * Description: This may be called with a page locked, so the removal is
+ * done by persist_remove_work(). Until then, the stored verdict is ignored
+ * (and for as long as the inode is cached if it cannot be removed).
+ */
+static void persist_remove(struct inode *inode)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(inode);
+
+	set_bit(DAZUKOFS_INODE_STALE, &dii->flags);
+
+	/* only fails while the inode is evicted, a shared writable mapping
+	 * already queued the removal when it was created */
+	if (!igrab(inode))
+		return;
+
+	if (!queue_work(persist_wq, &dii->persist_work))
+		iput(inode);
+}
+
+static void persist_remove_work(struct work_struct *work)
+{
+	struct dazukofs_inode_info *dii =
+		container_of(work, struct dazukofs_inode_info, persist_work);
+	struct inode *lower_inode = dii->lower_inode;
+	struct dentry *lower_dentry;
+	struct dentry *dentry;
+	int removed = 0;
+
+	/* any name of the file will do */
+	dentry = d_find_alias(&dii->vfs_inode);
+	if (!dentry)
+		goto out;
+
+	if (lower_inode->i_op->removexattr &&
+	    persist_want_write(dentry) == 0) {
+		lower_dentry = get_lower_dentry(dentry);
+		mutex_lock(&lower_inode->i_mutex);
+		lower_inode->i_op->removexattr(lower_dentry, PERSIST_XATTR);
+		mutex_unlock(&lower_inode->i_mutex);
+		mnt_drop_write(get_lower_mnt(dentry));
+		removed = 1;
+	}
+	dput(dentry);
+out:
+	if (removed)
+		clear_bit(DAZUKOFS_INODE_STALE, &dii->flags);
+	iput(&dii->vfs_inode);
+}
+
+/**
+ * dazukofs_persist_set_epoch - set the scanner epoch for stored verdicts
+ * @arg: the epoch (decimal)
+ * @unused: argument not used
+ *
+ * Description: This function is called by the device layer. Stored
+ * verdicts of other epochs are ignored (and replaced when the file is
+ * checked again).
+ *
+ * Returns 0 on success.
+ */
+int dazukofs_persist_set_epoch(const char *arg, int unused)
+{
+	unsigned long epoch;
+	char *end;
+
+	epoch = simple_strtoul(arg, &end, 10);
+	if (*end)
+		return -EINVAL;
+
+	atomic_long_set(&persist_epoch, epoch);
+
+	/* exportable verdicts of other epochs are never used again */
+	warm_purge(epoch);
+	return 0;
+}
+
+/**
+ * dazukofs_persist_lookup - get the stored verdict of a file
+ * @dentry: the dentry being accessed
+ * @ticket: the current state of the inode
+ * @groups: identifies the current set of groups giving verdicts
+ *
+ * Returns the stored verdict or VERDICT_NONE if nothing (valid) is stored.
+ */
+dazukofs_verdict_t dazukofs_persist_lookup(struct dentry *dentry,
+					   struct dazukofs_cache_ticket *ticket,
+					   u64 groups)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(dentry->d_inode);
+	struct dentry *lower_dentry = get_lower_dentry(dentry);
+	struct inode *lower_inode = lower_dentry->d_inode;
+	unsigned long epoch = atomic_long_read(&persist_epoch);
+	struct dazukofs_persist_record rec;
+	ssize_t len;
+
+	if (!epoch || !groups || !lower_inode ||
+	    !S_ISREG(lower_inode->i_mode) || !lower_inode->i_op->getxattr)
+		return VERDICT_NONE;
+
+	/* modified, but not removed yet */
+	if (test_bit(DAZUKOFS_INODE_STALE, &dii->flags))
+		return VERDICT_NONE;
+
+	if (mapping_writably_mapped(dentry->d_inode->i_mapping))
+		return VERDICT_NONE;
+
+	len = lower_inode->i_op->getxattr(lower_dentry, PERSIST_XATTR,
+					  &rec, sizeof(rec));
+	if (len <= 0)
+		return VERDICT_NONE;
+
+	/* whatever is stored is removed if the file is modified */
+	set_bit(DAZUKOFS_INODE_PERSISTED, &dii->flags);
+
+	if (len != sizeof(rec) ||
+	    le32_to_cpu(rec.version) != PERSIST_VERSION ||
+	    le64_to_cpu(rec.epoch) != epoch ||
+	    le64_to_cpu(rec.groups) != groups ||
+	    le64_to_cpu(rec.ctime_sec) != ticket->ctime.tv_sec ||
+	    le64_to_cpu(rec.ctime_nsec) != ticket->ctime.tv_nsec ||
+	    le64_to_cpu(rec.mtime_sec) != ticket->mtime.tv_sec ||
+	    le64_to_cpu(rec.mtime_nsec) != ticket->mtime.tv_nsec ||
+	    le64_to_cpu(rec.size) != ticket->size)
+		return VERDICT_NONE;
+
+	if (le32_to_cpu(rec.verdict) != VERDICT_ALLOW)
+		return VERDICT_NONE;
+
+	return VERDICT_ALLOW;
+}
+
+/* attempts to write a record that matches the ctime of its own write */
+#define PERSIST_TRIES	3
+
+/**
+ * dazukofs_persist_store - store an allow verdict for a file
+ * @dentry: the dentry that was checked
+ * @ticket: the state of the inode before the check was started
+ * @groups: identifies the set of groups that allowed access
+ *
+ * Description: Nothing is stored if the lower file changed since the
+ * ticket was prepared. The record is written again with the ctime of the
+ * previous write until it matches (usually once more, the ctime has a
+ * coarse granularity), otherwise it is removed. Errors are ignored,
+ * storing the verdict is only an optimization, and it is skipped if the
+ * filesystems are read-only or frozen.
+ *
+ * IMPORTANT: This function takes the i_mutex of the lower inode!
+ */
+void dazukofs_persist_store(struct dentry *dentry,
+			    struct dazukofs_cache_ticket *ticket, u64 groups)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(dentry->d_inode);
+	struct dentry *lower_dentry = get_lower_dentry(dentry);
+	struct inode *lower_inode = lower_dentry->d_inode;
+	unsigned long epoch = atomic_long_read(&persist_epoch);
+	struct dazukofs_persist_record rec;
+	struct timespec ctime;
+	int stored = 0;
+	int i;
+
+	if (!epoch || !groups || !lower_inode ||
+	    !S_ISREG(lower_inode->i_mode) || !lower_inode->i_op->setxattr)
+		return;
+
+	/* modified through DazukoFS meanwhile (or about to be)? */
+	if (ACCESS_ONCE(dii->change_count) != ticket->change_count ||
+	    test_bit(DAZUKOFS_INODE_STALE, &dii->flags) ||
+	    mapping_writably_mapped(dentry->d_inode->i_mapping))
+		return;
+
+	rec.version = cpu_to_le32(PERSIST_VERSION);
+	rec.verdict = cpu_to_le32(VERDICT_ALLOW);
+	rec.epoch = cpu_to_le64(epoch);
+	rec.groups = cpu_to_le64(groups);
+	rec.mtime_sec = cpu_to_le64(ticket->mtime.tv_sec);
+	rec.mtime_nsec = cpu_to_le64(ticket->mtime.tv_nsec);
+	rec.size = cpu_to_le64(ticket->size);
+
+	if (persist_want_write(dentry) != 0)
+		return;
+
+	mutex_lock(&lower_inode->i_mutex);
+
+	/* modified through the lower filesystem meanwhile? */
+	if (!timespec_equal(&lower_inode->i_ctime, &ticket->ctime) ||
+	    i_size_read(lower_inode) != ticket->size)
+		goto out;
+
+	set_bit(DAZUKOFS_INODE_PERSISTED, &dii->flags);
+
+	ctime = ticket->ctime;
+	for (i = 0; i < PERSIST_TRIES; i++) {
+		rec.ctime_sec = cpu_to_le64(ctime.tv_sec);
+		rec.ctime_nsec = cpu_to_le64(ctime.tv_nsec);
+		if (lower_inode->i_op->setxattr(lower_dentry, PERSIST_XATTR,
+						&rec, sizeof(rec), 0) != 0)
+			break;
+
+		if (timespec_equal(&lower_inode->i_ctime, &ctime)) {
+			stored = 1;
+			break;
+		}
+		ctime = lower_inode->i_ctime;
+	}
+
+	if (!stored && lower_inode->i_op->removexattr)
+		lower_inode->i_op->removexattr(lower_dentry, PERSIST_XATTR);
+out:
+	mutex_unlock(&lower_inode->i_mutex);
+	mnt_drop_write(get_lower_mnt(dentry));
+}
+
+/*
+ * Allow verdicts of the current scanner epoch are also kept in a table
+ * keyed by the lower filesystem UUID, inode number and generation. The
+ * table can be exported and imported through the control device, so that
+ * systems can start with the verdicts of another (identical) system. As
+ * for stored verdicts, the groups, ctime, modification time and size must
+ * match, and modifications through DazukoFS remove the record.
+ *
+ * The table is read under RCU, writers take the lock of the bucket. When
+ * the table is full, a new verdict replaces the oldest record of its
+ * bucket.
+ */
+#define WARM_HASH_BITS	10
+#define WARM_HASH_SIZE	(1 << WARM_HASH_BITS)
+
+struct dazukofs_warm_entry {
+	struct hlist_node hash_node;
+	struct rcu_head rcu;
+	struct dazukofs_cache_record rec;
+};
+
+struct dazukofs_warm_bucket {
+	/* protects: head (writers) */
+	spinlock_t lock;
+
+	struct hlist_head head;
+};
+
+static struct dazukofs_warm_bucket warm_hash[WARM_HASH_SIZE];
+static atomic_t warm_count = ATOMIC_INIT(0);
+
+static unsigned int warm_max = 65536;
+module_param(warm_max, uint, 0644);
+MODULE_PARM_DESC(warm_max,
+		 "maximum number of exportable verdicts (default 65536)");
+
+/**
+ * dazukofs_warm_init - initialize the table of exportable verdicts
+ */
+void dazukofs_warm_init(void)
+{
+	int i;
+
+	for (i = 0; i < WARM_HASH_SIZE; i++) {
+		spin_lock_init(&warm_hash[i].lock);
+		INIT_HLIST_HEAD(&warm_hash[i].head);
+	}
+}
+
+static struct dazukofs_warm_bucket *
+warm_bucket(const struct dazukofs_cache_record *rec)
+{
+	unsigned long key = le64_to_cpu(rec->ino);
+	int i;
+
+	key ^= le32_to_cpu(rec->generation);
+
+	for (i = 0; i < sizeof(rec->uuid); i++)
+		key = key * 31 + rec->uuid[i];
+
+	return &warm_hash[hash_long(key, WARM_HASH_BITS)];
+}
+
+static int same_file(const struct dazukofs_cache_record *a,
+		     const struct dazukofs_cache_record *b)
+{
+	return a->ino == b->ino && a->generation == b->generation &&
+	       memcmp(a->uuid, b->uuid, sizeof(a->uuid)) == 0;
+}
+
+/**
+ * make_key - identify a file across systems
+ * @lower_inode: the lower inode of the file
+ * @rec: the record to fill (all other members are cleared)
+ *
+ * Returns 0 if the file can be identified across systems.
+ */
+static int make_key(struct inode *lower_inode,
+		    struct dazukofs_cache_record *rec)
+{
+	static const u8 no_uuid[16];
+
+	if (!S_ISREG(lower_inode->i_mode))
+		return -1;
+
+	/* without a UUID the filesystem cannot be recognized */
+	if (memcmp(lower_inode->i_sb->s_uuid, no_uuid, sizeof(no_uuid)) == 0)
+		return -1;
+
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec->uuid, lower_inode->i_sb->s_uuid, sizeof(rec->uuid));
+	rec->ino = cpu_to_le64(lower_inode->i_ino);
+	rec->generation = cpu_to_le32(lower_inode->i_generation);
+
+	return 0;
+}
+
+/**
+ * make_record - fill a cache record for a file
+ * @dentry: the dentry of the file
+ * @ticket: the state of the inode
+ * @groups: identifies the set of groups giving verdicts
+ * @rec: the record to fill
+ *
+ * Returns 0 if the file can be identified across systems.
+ */
+static int make_record(struct dentry *dentry,
+		       struct dazukofs_cache_ticket *ticket, u64 groups,
+		       struct dazukofs_cache_record *rec)
+{
+	if (make_key(get_lower_inode(dentry->d_inode), rec) != 0)
+		return -1;
+
+	rec->mtime_nsec = cpu_to_le32(ticket->mtime.tv_nsec);
+	rec->mtime_sec = cpu_to_le64(ticket->mtime.tv_sec);
+	rec->ctime_nsec = cpu_to_le32(ticket->ctime.tv_nsec);
+	rec->ctime_sec = cpu_to_le64(ticket->ctime.tv_sec);
+	rec->size = cpu_to_le64(ticket->size);
+	rec->epoch = cpu_to_le64(atomic_long_read(&persist_epoch));
+	rec->groups = cpu_to_le64(groups);
+
+	return 0;
+}
+
+/**
+ * warm_insert - add a record to the table
+ * @rec: the record
+ * @evict: flag set if the oldest record of the bucket may be replaced
+ *
+ * Description: A record for the same file replaces the older one.
+ *
+ * Returns 0 on success, -ENOSPC if the table is full.
+ */
+static int warm_insert(const struct dazukofs_cache_record *rec, int evict)
+{
+	struct dazukofs_warm_bucket *b = warm_bucket(rec);
+	struct dazukofs_warm_entry *new_entry;
+	struct dazukofs_warm_entry *old = NULL;
+	struct dazukofs_warm_entry *e;
+	struct hlist_node *pos;
+	int full = atomic_read(&warm_count) >= ACCESS_ONCE(warm_max);
+
+	/* nothing could be replaced (the bucket is only read as a hint) */
+	if (full && evict && hlist_empty(&b->head))
+		return -ENOSPC;
+
+	new_entry = kmalloc(sizeof(*new_entry), GFP_KERNEL);
+	if (!new_entry)
+		return -ENOMEM;
+	new_entry->rec = *rec;
+
+	spin_lock(&b->lock);
+	hlist_for_each_entry(e, pos, &b->head, hash_node) {
+		if (same_file(&e->rec, rec)) {
+			old = e;
+			break;
+		}
+		/* new records are added at the head */
+		if (full && evict)
+			old = e;
+	}
+
+	if (old) {
+		hlist_replace_rcu(&old->hash_node, &new_entry->hash_node);
+	} else if (atomic_read(&warm_count) < ACCESS_ONCE(warm_max)) {
+		hlist_add_head_rcu(&new_entry->hash_node, &b->head);
+		atomic_inc(&warm_count);
+	} else {
+		spin_unlock(&b->lock);
+		kfree(new_entry);
+		return -ENOSPC;
+	}
+	spin_unlock(&b->lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+/**
+ * warm_remove - remove records from a bucket
+ * @b: the bucket
+ * @rec: only remove the record of this file (or NULL)
+ * @keep_epoch: only remove records of other epochs (or NULL)
+ *
+ * Description: All records are removed if @rec and @keep_epoch are NULL.
+ */
+static void warm_remove(struct dazukofs_warm_bucket *b,
+			const struct dazukofs_cache_record *rec,
+			const __le64 *keep_epoch)
+{
+	struct dazukofs_warm_entry *e;
+	struct hlist_node *pos;
+	struct hlist_node *tmp;
+
+	spin_lock(&b->lock);
+	hlist_for_each_entry_safe(e, pos, tmp, &b->head, hash_node) {
+		if (rec && !same_file(&e->rec, rec))
+			continue;
+		if (keep_epoch && e->rec.epoch == *keep_epoch)
+			continue;
+		hlist_del_rcu(&e->hash_node);
+		atomic_dec(&warm_count);
+		kfree_rcu(e, rcu);
+	}
+	spin_unlock(&b->lock);
+}
+
+/**
+ * dazukofs_warm_import - add a verdict to the table
+ * @rec: the record of an allowed file
+ *
+ * Description: A record for the same file replaces the older one. Records
+ * are only trusted if their epoch is the current scanner epoch.
+ *
+ * Returns 0 on success, -ENOSPC if the table is full.
+ */
+int dazukofs_warm_import(const struct dazukofs_cache_record *rec)
+{
+	return warm_insert(rec, 0);
+}
+
+/**
+ * dazukofs_warm_lookup - get the exportable verdict of a file
+ * @dentry: the dentry being accessed
+ * @ticket: the current state of the inode
+ * @groups: identifies the current set of groups giving verdicts
+ *
+ * Description: This does not take any locks.
+ *
+ * Returns VERDICT_ALLOW if a matching record exists, otherwise VERDICT_NONE.
+ */
+dazukofs_verdict_t dazukofs_warm_lookup(struct dentry *dentry,
+					struct dazukofs_cache_ticket *ticket,
+					u64 groups)
+{
+	struct dazukofs_cache_record rec;
+	struct dazukofs_warm_entry *e;
+	struct hlist_node *pos;
+	dazukofs_verdict_t verdict = VERDICT_NONE;
+
+	if (!atomic_long_read(&persist_epoch) || !groups ||
+	    !atomic_read(&warm_count))
+		return VERDICT_NONE;
+
+	if (mapping_writably_mapped(dentry->d_inode->i_mapping))
+		return VERDICT_NONE;
+
+	if (make_record(dentry, ticket, groups, &rec) != 0)
+		return VERDICT_NONE;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, pos, &warm_bucket(&rec)->head,
+				 hash_node) {
+		if (same_file(&e->rec, &rec)) {
+			if (memcmp(&e->rec, &rec, sizeof(rec)) == 0)
+				verdict = VERDICT_ALLOW;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return verdict;
+}
+
+/**
+ * dazukofs_warm_store - add an allowed file to the table
+ * @dentry: the dentry that was checked
+ * @ticket: the state of the inode before the check was started
+ * @groups: identifies the set of groups that allowed access
+ */
+void dazukofs_warm_store(struct dentry *dentry,
+			 struct dazukofs_cache_ticket *ticket, u64 groups)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(dentry->d_inode);
+	struct dazukofs_cache_record rec;
+
+	if (!atomic_long_read(&persist_epoch) || !groups)
+		return;
+
+	/* modified meanwhile (or about to be)? */
+	if (ACCESS_ONCE(dii->change_count) != ticket->change_count ||
+	    mapping_writably_mapped(dentry->d_inode->i_mapping))
+		return;
+
+	if (make_record(dentry, ticket, groups, &rec) != 0)
+		return;
+
+	warm_insert(&rec, 1);
+}
+
+/**
+ * warm_forget - remove the record of a modified file
+ * @inode: the modified inode
+ *
+ * Description: This may be called with a page locked.
+ */
+static void warm_forget(struct inode *inode)
+{
+	struct dazukofs_cache_record rec;
+
+	if (!atomic_read(&warm_count))
+		return;
+
+	if (make_key(get_lower_inode(inode), &rec) != 0)
+		return;
+
+	warm_remove(warm_bucket(&rec), &rec, NULL);
+}
+
+/**
+ * warm_purge - remove the records of other epochs
+ * @epoch: the new scanner epoch
+ */
+static void warm_purge(unsigned long epoch)
+{
+	__le64 keep_epoch = cpu_to_le64(epoch);
+	int i;
+
+	if (!atomic_read(&warm_count))
+		return;
+
+	for (i = 0; i < WARM_HASH_SIZE; i++)
+		warm_remove(&warm_hash[i], NULL, &keep_epoch);
+}
+
+/**
+ * dazukofs_warm_export - dump the table
+ * @buf: to be set to the allocated dump (header and records)
+ * @buflen: to be set to the length of the dump
+ *
+ * Description: Only records of the current scanner epoch are dumped.
+ * Records added while the table is dumped may be missing.
+ *
+ * Returns 0 on success.
+ */
+int dazukofs_warm_export(char **buf, size_t *buflen)
+{
+	struct dazukofs_cache_dump_header *hdr;
+	struct dazukofs_cache_record *rec;
+	struct dazukofs_warm_entry *e;
+	struct hlist_node *pos;
+	__le64 epoch = cpu_to_le64(atomic_long_read(&persist_epoch));
+	int max_count = atomic_read(&warm_count);
+	int count = 0;
+	int i;
+
+	*buf = vmalloc(sizeof(*hdr) + max_count * sizeof(*rec));
+	if (!*buf)
+		return -ENOMEM;
+
+	hdr = (struct dazukofs_cache_dump_header *)*buf;
+	memcpy(hdr->magic, DAZUKOFS_DUMP_MAGIC, sizeof(hdr->magic));
+	hdr->version = cpu_to_le32(DAZUKOFS_DUMP_VERSION);
+	rec = (struct dazukofs_cache_record *)(hdr + 1);
+
+	rcu_read_lock();
+	for (i = 0; i < WARM_HASH_SIZE && count < max_count; i++) {
+		hlist_for_each_entry_rcu(e, pos, &warm_hash[i].head,
+					 hash_node) {
+			if (count == max_count)
+				break;
+			if (e->rec.epoch == epoch)
+				rec[count++] = e->rec;
+		}
+	}
+	rcu_read_unlock();
+
+	*buflen = sizeof(*hdr) + count * sizeof(*rec);
+	return 0;
+}
+
+/**
+ * dazukofs_warm_destroy - free the table
+ */
+void dazukofs_warm_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < WARM_HASH_SIZE; i++)
+		warm_remove(&warm_hash[i], NULL, NULL);
+
+	/* wait for the records to be freed */
+	rcu_barrier();
+}
+
+/*
+ * Recent verdicts are also remembered per (process, file) for a short
+ * time. This catches processes that open the same file again and again
+ * (also denied files and files that cannot be cached). The table is
+ * direct-mapped, a new verdict simply replaces an older one.
+ */
+#define DEDUP_BITS	8
+#define DEDUP_SIZE	(1 << DEDUP_BITS)
+
+struct dazukofs_dedup_entry {
+	/* protects: all members */
+	spinlock_t lock;
+
+	pid_t tgid;
+
+	/* the lower inode is not referenced, so it is identified by
+	 * device, inode number and generation */
+	dev_t dev;
+	unsigned long ino;
+	__u32 generation;
+
+	unsigned long change_count;
+	struct timespec ctime;
+	u64 version;
+	unsigned long epoch;
+	unsigned long stamp;
+	int deny;
+} ____cacheline_aligned_in_smp;
+
+static struct dazukofs_dedup_entry dedup_table[DEDUP_SIZE];
+
+static unsigned int dedup_window_ms = 20;
+module_param(dedup_window_ms, uint, 0644);
+MODULE_PARM_DESC(dedup_window_ms,
+		 "time a verdict is reused for the same process (default 20)");
+
+/**
+ * dazukofs_dedup_init - initialize the recent verdict table
+ */
+void dazukofs_dedup_init(void)
+{
+	int i;
+
+	for (i = 0; i < DEDUP_SIZE; i++)
+		spin_lock_init(&dedup_table[i].lock);
+}
+
+static struct dazukofs_dedup_entry *dedup_entry(struct inode *lower_inode,
+						pid_t tgid)
+{
+	unsigned long key = lower_inode->i_ino ^ lower_inode->i_sb->s_dev;
+
+	return &dedup_table[hash_long(key + tgid, DEDUP_BITS)];
+}
+
+/**
+ * dedup_match - check if an entry is about the same unmodified file
+ * @e: the entry (locked)
+ * @lower_inode: the lower inode being accessed
+ * @ticket: the current state of the inode
+ *
+ * Description: The change count of the DazukoFS inode catches
+ * modifications through DazukoFS within the timestamp granularity. The
+ * change count is not reset when an inode is reused, so the lower ctime
+ * (and i_version) must match as well.
+ */
+static int dedup_match(struct dazukofs_dedup_entry *e,
+		       struct inode *lower_inode,
+		       struct dazukofs_cache_ticket *ticket)
+{
+	return e->dev == lower_inode->i_sb->s_dev &&
+	       e->ino == lower_inode->i_ino &&
+	       e->generation == lower_inode->i_generation &&
+	       e->change_count == ticket->change_count &&
+	       timespec_equal(&e->ctime, &ticket->ctime) &&
+	       e->version == ticket->version &&
+	       e->epoch == ticket->epoch;
+}
+
+/**
+ * dazukofs_dedup_lookup - get a recent verdict for the current process
+ * @inode: the inode being accessed
+ * @ticket: the current state of the inode
+ * @deny: set to the recent verdict
+ *
+ * Description: A verdict is only reused if the current process was given
+ * it for the same (unmodified) file within the last dedup_window_ms.
+ *
+ * Returns 1 if a recent verdict was found.
+ */
+int dazukofs_dedup_lookup(struct inode *inode,
+			  struct dazukofs_cache_ticket *ticket, int *deny)
+{
+	struct inode *lower_inode = get_lower_inode(inode);
+	unsigned int window = ACCESS_ONCE(dedup_window_ms);
+	pid_t tgid = task_tgid_nr(current);
+	struct dazukofs_dedup_entry *e;
+	int found = 0;
+
+	if (!window)
+		return 0;
+
+	e = dedup_entry(lower_inode, tgid);
+
+	spin_lock(&e->lock);
+	if (e->tgid == tgid && dedup_match(e, lower_inode, ticket) &&
+	    time_before(jiffies, e->stamp + msecs_to_jiffies(window))) {
+		*deny = e->deny;
+		found = 1;
+	}
+	spin_unlock(&e->lock);
+
+	return found;
+}
+
+/**
+ * dazukofs_dedup_store - remember a verdict for the current process
+ * @inode: the inode that was checked
+ * @ticket: the state of the inode before the check was started
+ * @deny: the verdict
+ */
+void dazukofs_dedup_store(struct inode *inode,
+			  struct dazukofs_cache_ticket *ticket, int deny)
+{
+	struct inode *lower_inode = get_lower_inode(inode);
+	pid_t tgid = task_tgid_nr(current);
+	struct dazukofs_dedup_entry *e;
+
+	if (!ACCESS_ONCE(dedup_window_ms))
+		return;
+
+	e = dedup_entry(lower_inode, tgid);
+
+	spin_lock(&e->lock);
+	e->tgid = tgid;
+	e->dev = lower_inode->i_sb->s_dev;
+	e->ino = lower_inode->i_ino;
+	e->generation = lower_inode->i_generation;
+	e->change_count = ticket->change_count;
+	e->ctime = ticket->ctime;
+	e->version = ticket->version;
+	e->epoch = ticket->epoch;
+	e->stamp = jiffies;
+	e->deny = deny;
+	spin_unlock(&e->lock);
+}
@@ -0,0 +1,107 @@
+/* dazukofs: access control stackable filesystem
+
+   Copyright (C) 2008-2010 John Ogness
+     Author: John Ogness <dazukocode@ogness.net>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <linux/fs.h>
+
+typedef enum {
+	VERDICT_NONE,
+	VERDICT_ALLOW,
+	VERDICT_DENY,
+} dazukofs_verdict_t;
+
+/* exported verdicts (see dazukofs_warm_export()), all little endian */
+#define DAZUKOFS_DUMP_MAGIC	"DZKC"
+#define DAZUKOFS_DUMP_VERSION	2
+
+struct dazukofs_cache_dump_header {
+	char magic[4];
+	__le32 version;
+};
+
+struct dazukofs_cache_record {
+	__u8 uuid[16];
+	__le64 ino;
+	__le32 generation;
+	__le32 mtime_nsec;
+	__le64 mtime_sec;
+	__le32 ctime_nsec;
+	__le32 reserved;
+	__le64 ctime_sec;
+	__le64 size;
+	__le64 epoch;
+	__le64 groups;
+};
+
+struct dazukofs_cache_ticket {
+	unsigned long change_count;
+	unsigned long epoch;
+
+	/* state of the lower inode, for verdicts that outlive the inode
+	 * (ctime and i_version cannot be set by users) */
+	struct timespec mtime;
+	struct timespec ctime;
+	u64 version;
+	loff_t size;
+};
+
+extern void dazukofs_cache_init_inode(struct inode *inode);
+extern dazukofs_verdict_t dazukofs_cache_lookup(struct inode *inode);
+extern void dazukofs_cache_prepare(struct inode *inode,
+				   struct dazukofs_cache_ticket *ticket);
+extern void dazukofs_cache_store(struct inode *inode,
+				 struct dazukofs_cache_ticket *ticket,
+				 dazukofs_verdict_t verdict);
+extern void dazukofs_cache_invalidate(struct inode *inode);
+extern void dazukofs_cache_new_epoch(void);
+
+extern int dazukofs_persist_init(void);
+extern void dazukofs_persist_flush(void);
+extern void dazukofs_persist_destroy(void);
+extern int dazukofs_persist_set_epoch(const char *arg, int unused);
+extern dazukofs_verdict_t dazukofs_persist_lookup(struct dentry *dentry,
+				struct dazukofs_cache_ticket *ticket,
+				u64 groups);
+extern void dazukofs_persist_store(struct dentry *dentry,
+				   struct dazukofs_cache_ticket *ticket,
+				   u64 groups);
+
+extern void dazukofs_warm_init(void);
+extern int dazukofs_warm_import(const struct dazukofs_cache_record *rec);
+extern dazukofs_verdict_t dazukofs_warm_lookup(struct dentry *dentry,
+				struct dazukofs_cache_ticket *ticket,
+				u64 groups);
+extern void dazukofs_warm_store(struct dentry *dentry,
+				struct dazukofs_cache_ticket *ticket,
+				u64 groups);
+extern int dazukofs_warm_export(char **buf, size_t *buflen);
+extern void dazukofs_warm_destroy(void);
+
+extern void dazukofs_dedup_init(void);
+extern int dazukofs_dedup_lookup(struct inode *inode,
+				 struct dazukofs_cache_ticket *ticket,
+				 int *deny);
+extern void dazukofs_dedup_store(struct inode *inode,
+				 struct dazukofs_cache_ticket *ticket,
+				 int deny);
+
+#endif /* __CACHE_H */
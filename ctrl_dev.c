@@ -24,26 +24,60 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
 
 #include "event.h"
+#include "cache.h"
 #include "dev.h"
 
+struct dazukofs_ctrl_file {
+	/* protects: all fields (reads and writes may run concurrently) */
+	struct mutex lock;
+
+	/* the data returned by read (group list or cache dump) */
+	char *buf;
+	size_t buflen;
+	int buf_vmalloc;
+
+	/* set after "import", further writes are a cache dump */
+	int import;
+	size_t import_pos;
+	struct dazukofs_cache_dump_header header;
+	struct dazukofs_cache_record record;
+};
+
 static int dazukofs_ctrl_open(struct inode *inode, struct file *file)
 {
-	file->private_data = NULL;
+	struct dazukofs_ctrl_file *cf;
+
+	cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+	if (!cf)
+		return -ENOMEM;
+
+	mutex_init(&cf->lock);
+	file->private_data = cf;
 	return 0;
 }
 
+static void free_read_buffer(struct dazukofs_ctrl_file *cf)
+{
+	if (!cf->buf)
+		return;
+
+	if (cf->buf_vmalloc)
+		vfree(cf->buf);
+	else
+		kfree(cf->buf);
+	cf->buf = NULL;
+}
+
 static int dazukofs_ctrl_release(struct inode *inode, struct file *file)
 {
-	/*
-	 * checkpatch.pl recommends not checking for NULL before freeing
-	 * the data because kfree(NULL) is allowed. However, that is
-	 * poor style and leads to sloppy programming.
-	 */
+	struct dazukofs_ctrl_file *cf = file->private_data;
 
-	if (file->private_data)
-		kfree(file->private_data);
+	free_read_buffer(cf);
+	kfree(cf);
 
 	return 0;
 }
@@ -51,30 +85,46 @@ static int dazukofs_ctrl_release(struct inode *inode, struct file *file)
 static ssize_t dazukofs_ctrl_read(struct file *file, char __user *buffer,
 				  size_t length, loff_t *pos)
 {
-	char *buf = file->private_data;
+	struct dazukofs_ctrl_file *cf = file->private_data;
+	char *buf;
 	size_t buflen;
+	ssize_t ret;
 	int err;
 
-	if (!file->private_data) {
+	/* "export" may replace the buffer meanwhile */
+	mutex_lock(&cf->lock);
+
+	if (!cf->buf) {
 		err = dazukofs_get_groups(&buf);
-		if (err)
-			return err;
-		file->private_data = buf;
+		if (err) {
+			ret = err;
+			goto out;
+		}
+		cf->buf = buf;
+		cf->buflen = strlen(buf);
+		cf->buf_vmalloc = 0;
 	}
-	buflen = strlen(buf);
+	buf = cf->buf;
+	buflen = cf->buflen;
 
-	if (*pos >= buflen)
-		return 0;
+	if (*pos >= buflen) {
+		ret = 0;
+		goto out;
+	}
 
 	if (length > buflen - *pos)
 		length = buflen - *pos;
 
-	if (copy_to_user(buffer, buf + *pos, length))
-		return -EFAULT;
+	if (copy_to_user(buffer, buf + *pos, length)) {
+		ret = -EFAULT;
+		goto out;
+	}
 
 	*pos += length;
-
-	return length;
+	ret = length;
+out:
+	mutex_unlock(&cf->lock);
+	return ret;
 }
 
 #define DAZUKOFS_ALLOWED_GROUPCHARS \
@@ -113,16 +163,190 @@ static int process_command(char *buf, const char *key,
 	return 0;
 }
 
+/* the time a group may take to answer is limited to one hour */
+#define DAZUKOFS_MAX_TIMEOUT	3600000
+
+static int process_timeout_command(char *buf, int *retcode)
+{
+	const char *key = "timeout=";
+	unsigned long msecs;
+	int deny = 0;
+	char *p;
+	char *p2;
+	char *p3;
+
+	p = strstr(buf, key);
+	if (!p)
+		return -1;
+
+	p += strlen(key);
+
+	for (p2 = p; is_valid_char(*p2); p2++)
+		;
+
+	*retcode = -EINVAL;
+
+	if (p == p2 || *p2 != ':')
+		return 0;
+
+	msecs = simple_strtoul(p2 + 1, &p3, 10);
+	if (p3 == p2 + 1 || msecs > DAZUKOFS_MAX_TIMEOUT)
+		return 0;
+
+	if (*p3 == ':') {
+		p3++;
+		if (strncmp(p3, "deny", 4) == 0) {
+			deny = 1;
+		} else if (strncmp(p3, "allow", 5) != 0) {
+			return 0;
+		}
+	}
+
+	*p2 = 0;
+	*retcode = dazukofs_set_group_timeout(p, msecs, deny);
+	*p2 = ':';
+
+	return 0;
+}
+
+static int process_epoch_command(char *buf, int *retcode)
+{
+	const char *key = "epoch=";
+	unsigned long epoch;
+	char *p;
+	char *p2;
+	char *p3;
+
+	p = strstr(buf, key);
+	if (!p)
+		return -1;
+
+	p += strlen(key);
+
+	for (p2 = p; is_valid_char(*p2); p2++)
+		;
+
+	*retcode = -EINVAL;
+
+	if (p == p2 || *p2 != ':')
+		return 0;
+
+	epoch = simple_strtoul(p2 + 1, &p3, 10);
+	if (p3 == p2 + 1)
+		return 0;
+
+	*p2 = 0;
+	*retcode = dazukofs_set_group_epoch(p, epoch);
+	*p2 = ':';
+
+	return 0;
+}
+
+/**
+ * export_cache - process an "export" command
+ * @cf: the control file (lock held)
+ *
+ * Description: Further reads (from position 0) return the cache dump
+ * instead of the group list.
+ *
+ * Returns 0 on success.
+ */
+static int export_cache(struct dazukofs_ctrl_file *cf)
+{
+	char *buf;
+	size_t buflen;
+	int err;
+
+	err = dazukofs_warm_export(&buf, &buflen);
+	if (err)
+		return err;
+
+	free_read_buffer(cf);
+	cf->buf = buf;
+	cf->buflen = buflen;
+	cf->buf_vmalloc = 1;
+
+	return 0;
+}
+
+/**
+ * import_cache - process a write in import mode
+ * @cf: the control file (lock held)
+ * @buffer: the user buffer with (part of) a cache dump
+ * @length: the length of the buffer
+ *
+ * Description: A dump may be written in pieces of any size. The header
+ * is checked before the first record is imported.
+ *
+ * Returns the number of bytes consumed or a negative error.
+ */
+static ssize_t import_cache(struct dazukofs_ctrl_file *cf,
+			    const char __user *buffer, size_t length)
+{
+	size_t hdr_len = sizeof(cf->header);
+	size_t rec_len = sizeof(cf->record);
+	size_t done = 0;
+	size_t off;
+	size_t n;
+	int err;
+
+	while (done < length) {
+		if (cf->import_pos < hdr_len) {
+			off = cf->import_pos;
+			n = min(length - done, hdr_len - off);
+			if (copy_from_user((char *)&cf->header + off,
+					   buffer + done, n))
+				return -EFAULT;
+			cf->import_pos += n;
+			done += n;
+
+			if (cf->import_pos == hdr_len &&
+			    (memcmp(cf->header.magic, DAZUKOFS_DUMP_MAGIC,
+				    sizeof(cf->header.magic)) != 0 ||
+			     le32_to_cpu(cf->header.version) !=
+			     DAZUKOFS_DUMP_VERSION)) {
+				cf->import = 0;
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		off = (cf->import_pos - hdr_len) % rec_len;
+		n = min(length - done, rec_len - off);
+		if (copy_from_user((char *)&cf->record + off, buffer + done, n))
+			return -EFAULT;
+		cf->import_pos += n;
+		done += n;
+
+		if (off + n == rec_len) {
+			err = dazukofs_warm_import(&cf->record);
+			if (err)
+				return err;
+		}
+	}
+
+	return done;
+}
+
 static ssize_t dazukofs_ctrl_write(struct file *file,
 				   const char __user *buffer, size_t length,
 				   loff_t *pos)
 {
-#define DAZUKOFS_MAX_WRITE_BUFFER 32
+#define DAZUKOFS_MAX_WRITE_BUFFER 64
+	struct dazukofs_ctrl_file *cf = file->private_data;
 	char tmp[DAZUKOFS_MAX_WRITE_BUFFER];
 	int match = 0;
 	int ret = -EINVAL;
 	int cp_len = length;
 
+	mutex_lock(&cf->lock);
+	if (cf->import) {
+		ret = import_cache(cf, buffer, length);
+		mutex_unlock(&cf->lock);
+		return ret;
+	}
+	mutex_unlock(&cf->lock);
+
 	cp_len = (length >= DAZUKOFS_MAX_WRITE_BUFFER) ?
 				(DAZUKOFS_MAX_WRITE_BUFFER - 1) : length;
 	if (copy_from_user(tmp, buffer, cp_len))
@@ -130,6 +354,23 @@ static ssize_t dazukofs_ctrl_write(struct file *file,
 
 	tmp[cp_len] = 0;
 
+	if (strncmp(tmp, "export", 6) == 0) {
+		mutex_lock(&cf->lock);
+		ret = export_cache(cf);
+		if (ret == 0)
+			*pos = 0;
+		mutex_unlock(&cf->lock);
+		return ret ? ret : length;
+	}
+
+	if (strncmp(tmp, "import", 6) == 0) {
+		mutex_lock(&cf->lock);
+		cf->import = 1;
+		cf->import_pos = 0;
+		mutex_unlock(&cf->lock);
+		return length;
+	}
+
 	if (!match || (match && ret >= 0)) {
 		if (process_command(tmp, "del=",
 				    dazukofs_remove_group, 0, &ret) == 0) {
@@ -146,7 +387,33 @@ static ssize_t dazukofs_ctrl_write(struct file *file,
 
 	if (!match || (match && ret >= 0)) {
 		if (process_command(tmp, "addtrack=",
-				    dazukofs_add_group, 1, &ret) == 0) {
+				    dazukofs_add_group, DAZUKOFS_GROUP_TRACK,
+				    &ret) == 0) {
+			match = 1;
+		}
+	}
+
+	if (!match || (match && ret >= 0)) {
+		if (process_command(tmp, "addnotify=",
+				    dazukofs_add_group, DAZUKOFS_GROUP_NOTIFY,
+				    &ret) == 0) {
+			match = 1;
+		}
+	}
+
+	if (!match || (match && ret >= 0)) {
+		if (process_timeout_command(tmp, &ret) == 0)
+			match = 1;
+	}
+
+	if (!match || (match && ret >= 0)) {
+		if (process_epoch_command(tmp, &ret) == 0)
+			match = 1;
+	}
+
+	if (!match || (match && ret >= 0)) {
+		if (process_command(tmp, "persist=",
+				    dazukofs_persist_set_epoch, 0, &ret) == 0) {
 			match = 1;
 		}
 	}
@@ -35,6 +35,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/version.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 extern struct kmem_cache *dazukofs_dentry_info_cachep;
 extern struct kmem_cache *dazukofs_file_info_cachep;
@@ -47,13 +49,45 @@ extern int dazukofs_interpose(struct dentry *lower_dentry,
 			      struct dentry *dentry, struct super_block *sb,
 			      int already_hashed);
 
+struct dazukofs_event;
+
 struct dazukofs_sb_info {
 	struct super_block *lower_sb;
 };
 
+/* the inode is kept for a background rescan (see event.c) */
+#define DAZUKOFS_INODE_HOT		0
+/* the lower file may have a stored verdict (see cache.c) */
+#define DAZUKOFS_INODE_PERSISTED	1
+/* the stored verdict is being removed (see cache.c) */
+#define DAZUKOFS_INODE_STALE		2
+
 struct dazukofs_inode_info {
 	struct inode *lower_inode;
 
+	/* protects: change_count, verdict (writers only), inflight */
+	spinlock_t verdict_lock;
+
+	unsigned long change_count;
+	unsigned long verdict;
+
+	/* state of the lower inode when the cached verdict was given, it
+	 * may also be modified without DazukoFS (read with verdict_seq) */
+	seqcount_t verdict_seq;
+	struct timespec verdict_ctime;
+	u64 verdict_version;
+	loff_t verdict_size;
+
+	/* the event currently checking this inode (shared by all
+	 * concurrent accesses) */
+	struct dazukofs_event *inflight;
+
+	/* DAZUKOFS_INODE_* bits */
+	unsigned long flags;
+
+	/* removes the stored verdict after a modification */
+	struct work_struct persist_work;
+
 	/*
 	 * the inode (embedded)
 	 */
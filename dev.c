@@ -22,6 +22,7 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
+#include <linux/moduleparam.h>
 
 #include "dazukofs_fs.h"
 #include "event.h"
@@ -33,16 +34,29 @@ static int dev_major;
 static int dev_minor_start;
 static int dev_minor_end;
 
+unsigned int dazukofs_max_groups = DEFAULT_GROUP_COUNT;
+module_param_named(max_groups, dazukofs_max_groups, uint, 0444);
+MODULE_PARM_DESC(max_groups, "maximum number of groups (default 10)");
+
 int dazukofs_dev_init(void)
 {
 	int err;
 	dev_t devt;
 
+	if (dazukofs_max_groups == 0 ||
+	    dazukofs_max_groups > MAX_GROUP_COUNT) {
+		printk(KERN_ERR "dazukofs: max_groups must be 1-%d\n",
+		       MAX_GROUP_COUNT);
+		err = -EINVAL;
+		goto error_out1;
+	}
+
 	err = dazukofs_init_events();
 	if (err)
 		goto error_out1;
 
-	err = alloc_chrdev_region(&devt, 0, 2 + GROUP_COUNT, DEVICE_NAME);
+	err = alloc_chrdev_region(&devt, 0, 3 + dazukofs_max_groups,
+				  DEVICE_NAME);
 	if (err)
 		goto error_out2;
 	dev_major = MAJOR(devt);
@@ -64,16 +78,24 @@ int dazukofs_dev_init(void)
 	if (err)
 		goto error_out5;
 
+	err = dazukofs_async_dev_init(dev_major, dev_minor_start + 2,
+				      dazukofs_class);
+	if (err)
+		goto error_out6;
+
 	dev_minor_end = dazukofs_group_dev_init(dev_major,
-						dev_minor_start + 2,
+						dev_minor_start + 3,
 						dazukofs_class);
 	if (dev_minor_end < 0) {
 		err = dev_minor_end;
-		goto error_out6;
+		goto error_out7;
 	}
 
 	return 0;
 
+error_out7:
+	dazukofs_async_dev_destroy(dev_major, dev_minor_start + 2,
+				   dazukofs_class);
 error_out6:
 	dazukofs_ign_dev_destroy(dev_major, dev_minor_start + 1,
 				 dazukofs_class);
@@ -83,7 +105,7 @@ error_out4:
 	class_destroy(dazukofs_class);
 error_out3:
 	unregister_chrdev_region(MKDEV(dev_major, dev_minor_start),
-				 2 + GROUP_COUNT);
+				 3 + dazukofs_max_groups);
 error_out2:
 	dazukofs_destroy_events();
 error_out1:
@@ -92,13 +114,15 @@ error_out1:
 
 void dazukofs_dev_destroy(void)
 {
-	dazukofs_group_dev_destroy(dev_major, dev_minor_start + 2,
+	dazukofs_group_dev_destroy(dev_major, dev_minor_start + 3,
 				   dev_minor_end, dazukofs_class);
+	dazukofs_async_dev_destroy(dev_major, dev_minor_start + 2,
+				   dazukofs_class);
 	dazukofs_ign_dev_destroy(dev_major, dev_minor_start + 1,
 				 dazukofs_class);
 	dazukofs_ctrl_dev_destroy(dev_major, dev_minor_start, dazukofs_class);
 	class_destroy(dazukofs_class);
 	unregister_chrdev_region(MKDEV(dev_major, dev_minor_start),
-				 2 + GROUP_COUNT);
+				 3 + dazukofs_max_groups);
 	dazukofs_destroy_events();
 }
@@ -24,7 +24,10 @@
 #include <linux/device.h>
 
 #define DEVICE_NAME	"dazukofs"
-#define GROUP_COUNT	10
+#define DEFAULT_GROUP_COUNT	10
+#define MAX_GROUP_COUNT		1024
+
+extern unsigned int dazukofs_max_groups;
 
 extern int dazukofs_dev_init(void);
 extern void dazukofs_dev_destroy(void);
@@ -46,4 +49,10 @@ extern void dazukofs_ign_dev_destroy(int dev_major, int dev_minor,
 				     struct class *dazukofs_class);
 extern int dazukofs_check_ignore_process(void);
 
+extern int dazukofs_async_dev_init(int dev_major, int dev_minor,
+				   struct class *dazukofs_class);
+extern void dazukofs_async_dev_destroy(int dev_major, int dev_minor,
+				       struct class *dazukofs_class);
+extern int dazukofs_check_async_process(void);
+
 #endif /* __DEV_H */
@@ -24,76 +24,328 @@
 #include <linux/fs.h>
 #include <linux/path.h>
 #include <linux/mount.h>
-#include <linux/freezer.h>
 #include <linux/cred.h>
 #include <linux/pid.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/mutex.h>
+#include <linux/jump_label.h>
+#include <linux/completion.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/mempool.h>
+#include <linux/jhash.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
 
 #include "dev.h"
 #include "dazukofs_fs.h"
 #include "event.h"
+#include "cache.h"
 
 struct dazukofs_proc {
-	struct list_head list;
-	struct pid *proc_id;
+	struct hlist_node hash_node;
+	struct task_struct *task;
 	int within_list;
 };
 
+/* container locations (ec->where) */
+#define EC_NONE		0
+#define EC_TODO		1
+#define EC_WORKING	2
+
+/* container flags (ec->flags) */
+#define EC_RESOLVED	0
+
+struct dazukofs_event_container {
+	struct list_head list;
+	struct hlist_node hash_node;
+	struct dazukofs_event *event;
+	struct dazukofs_group *grp;
+	struct file *file;
+	int fd;
+
+	/* set once the group's answer has been given to the event */
+	unsigned long flags;
+
+	/* where the container is, only changed under the lock of
+	 * the todo queue or working hash bucket */
+	int where;
+	struct dazukofs_todo_queue *queue;
+
+	/* when the default answer is given (0 for never) */
+	unsigned long deadline;
+	int timeout_deny;
+
+	/* set for notification groups, the opener does not wait for them */
+	int notify;
+};
+
+/*
+ * Containers are allocated in chunks, so that events for many groups do not
+ * need large (high order) allocations. The first chunk is part of the
+ * event.
+ */
+#define EC_CHUNK_SIZE	8
+
+struct dazukofs_container_chunk {
+	/* set if the chunk was taken from the reserve pool */
+	int from_pool;
+
+	struct dazukofs_event_container containers[EC_CHUNK_SIZE];
+};
+
 struct dazukofs_event {
 	unsigned long event_id;
 	struct dentry *dentry;
 	struct vfsmount *mnt;
 	struct pid *proc_id;
-	wait_queue_head_t queue;
 
-	/* protects: deny, deprecated, assigned */
-	struct mutex assigned_mutex;
+	/* completed when the last group has answered */
+	struct completion done;
+
+	/* number of groups that have not answered yet */
+	atomic_t assigned;
+
+	/* the opener holds one reference, each assigned group one more */
+	atomic_t refcount;
 
+	/* only ever set to 1, read after completion */
 	int deny;
-	int deprecated;
-	int assigned;
+
+	/* set if the event was taken from the reserve pool */
+	int from_pool;
+
+	/* set if the event is only posted to notification groups */
+	int notify_only;
+
+	/* set if nobody waits for the event (a trusted opener), the
+	 * verdict is then only recorded for the inode */
+	int async;
+	struct dazukofs_cache_ticket ticket;
+
+	/* set if a group gave its default answer, the verdict is not cached */
+	int unchecked;
+
+	/* the set of groups (other than notification groups) the event
+	 * was assigned to, see set_hash */
+	u64 groups;
+
+	/* one container per group, the chunks are indexed by
+	 * container / EC_CHUNK_SIZE */
+	int container_count;
+	struct dazukofs_container_chunk first_chunk;
+	struct dazukofs_container_chunk *chunks[0];
 };
 
-struct dazukofs_event_container {
+/* claimed events are indexed by their event id */
+#define WORKING_HASH_BITS	8
+#define WORKING_HASH_SIZE	(1 << WORKING_HASH_BITS)
+
+/* events waiting to be claimed, one queue per cpu */
+struct dazukofs_todo_queue {
+	/* protects: list */
+	spinlock_t lock;
+
 	struct list_head list;
-	struct dazukofs_event *event;
-	struct file *file;
-	int fd;
 };
 
+struct dazukofs_working_bucket {
+	/* protects: head */
+	spinlock_t lock;
+
+	struct hlist_head head;
+};
+
+/*
+ * A container is always owned by exactly one party: it is either on a
+ * todo queue, in the working hash, or held by the process that moves it
+ * between them. Whoever moves a container must check grp->deprecated
+ * under the lock of the destination. If the group was removed, it must
+ * release the container itself.
+ *
+ * If the group does not answer in time, the opener resolves the container
+ * (EC_RESOLVED) and takes it from the todo queue or working hash. A
+ * container that is being moved at that time is released by its mover,
+ * which checks EC_RESOLVED after setting ec->where under the lock of the
+ * destination.
+ */
 struct dazukofs_group {
 	struct list_head list;
 	char *name;
 	size_t name_length;
 	unsigned long group_id;
-	struct dazukofs_event_container todo_list;
+
+	struct dazukofs_todo_queue __percpu *todo;
+	atomic_t todo_count;
 	wait_queue_head_t queue;
 	wait_queue_head_t poll_queue;
-	struct dazukofs_event_container working_list;
+	struct dazukofs_working_bucket working_hash[WORKING_HASH_SIZE];
 	atomic_t use_count;
 	int tracking;
 	int track_count;
+
+	/* events are posted, but never waited for */
+	int notify;
+
+	/* set before the group queues are emptied on removal */
 	int deprecated;
+
+	/* the answer given if the group does not answer in time */
+	unsigned long timeout;
+	int timeout_deny;
+	atomic_long_t timeouts;
+
+	/* health of a group with a timeout: after too many missed deadlines
+	 * in a row (or too large a backlog), the group is degraded and its
+	 * default answer is given without queuing events */
+	atomic_t misses;
+	int degraded;
+	atomic_long_t bypassed;
+
+	/* supplied by the scanner, changed when its verdicts may change */
+	unsigned long scan_epoch;
+
+	/* identifies the group and its scan_epoch in a set of groups */
+	u64 set_hash;
 };
 
+/*
+ * Active groups are reachable through group_list and through group_table
+ * (indexed by group id). Both are read under rcu_read_lock(). A group
+ * holds one use_count reference for being registered, which is dropped
+ * after a grace period once the group has been removed.
+ */
 static struct dazukofs_group group_list;
+static struct dazukofs_group __rcu **group_table;
 static int group_count;
 
-/* protects: group_list, group_count */
-static struct rw_semaphore group_count_sem;
+/* number of notification groups (included in group_count) */
+static int notify_count;
+
+/*
+ * Identifies the set of active groups giving verdicts (the xor of their
+ * set_hash), so that stored verdicts are only used for the same groups
+ * at the same scanner epochs. It is 0 if there are no such groups.
+ */
+static atomic64_t verdict_groups = ATOMIC64_INIT(0);
+
+/* protects: group_list, group_table, group_count, notify_count (writers),
+ *	     verdict_groups (writers), grp->tracking, grp->track_count,
+ *	     grp->scan_epoch, grp->set_hash (writers) */
+static DEFINE_MUTEX(group_mutex);
+
+/* enabled while at least one group exists (patched at runtime) */
+static struct static_key groups_active = STATIC_KEY_INIT_FALSE;
+
+/* masked processes are hashed by their task */
+#define PROC_HASH_BITS	6
+#define PROC_HASH_SIZE	(1 << PROC_HASH_BITS)
+
+struct dazukofs_proc_bucket {
+	/* protects: head */
+	spinlock_t lock;
 
-/* protects: group_list, grp->members, last_event_id,
- *	     todo_list, working_list */
-static struct mutex work_mutex;
+	struct hlist_head head;
+};
+
+static struct dazukofs_proc_bucket proc_hash[PROC_HASH_SIZE];
 
-static struct mutex proc_mutex;
-static struct dazukofs_proc proc_list;
+/* number of currently masked processes */
+static atomic_t proc_count = ATOMIC_INIT(0);
 
 static struct kmem_cache *dazukofs_group_cachep;
-static struct kmem_cache *dazukofs_event_container_cachep;
-static struct kmem_cache *dazukofs_event_cachep;
 
-static int last_event_id;
+/*
+ * Events and container chunks are reserved for memory pressure. The chunk
+ * reserve holds at least the chunks of one event for max_groups groups.
+ * Only one process at a time takes from the reserves, so it cannot end up
+ * waiting for chunks held by another process that is still allocating.
+ */
+#define EVENT_POOL_RESERVE	16
+static mempool_t *dazukofs_event_pool;
+static mempool_t *dazukofs_chunk_pool;
+static DEFINE_MUTEX(event_pool_mutex);
+
+static atomic_long_t last_event_id = ATOMIC_LONG_INIT(0);
+
+/*
+ * Files with cached allow verdicts that are accessed again are "hot". The
+ * inodes of the last rescan_max of them are kept so that they can be
+ * checked again in the background when a group changes its scanner epoch.
+ * Only the inodes are referenced, so the mounts stay free to be unmounted.
+ * The inodes of a superblock are dropped when it is shut down. An inode is
+ * hot (DAZUKOFS_INODE_HOT) while it is kept.
+ */
+static unsigned int rescan_max;
+module_param(rescan_max, uint, 0444);
+MODULE_PARM_DESC(rescan_max,
+		 "number of hot files rescanned on a new epoch (default 0)");
+
+static struct inode **hot_files;
+static unsigned int hot_next;
+
+/* the superblock of the file being checked again, and whether to give up */
+static struct super_block *rescan_sb;
+static int rescan_abort;
+static DECLARE_WAIT_QUEUE_HEAD(rescan_idle);
+
+/* protects: hot_files, hot_next, rescan_sb, rescan_abort */
+static DEFINE_SPINLOCK(hot_lock);
+
+static struct workqueue_struct *rescan_wq;
+static struct work_struct rescan_work;
+static void rescan_hot_files(struct work_struct *work);
+
+/**
+ * chunk_count - get the number of container chunks of an event
+ * @container_count: the number of containers (groups) of the event
+ */
+static int chunk_count(int container_count)
+{
+	return DIV_ROUND_UP(container_count, EC_CHUNK_SIZE);
+}
+
+/**
+ * event_size - get the allocation size of an event
+ * @container_count: the number of containers (groups) of the event
+ */
+static size_t event_size(int container_count)
+{
+	/* chunks[0] always points to the first chunk */
+	return sizeof(struct dazukofs_event) +
+	       max(chunk_count(container_count), 1) *
+	       sizeof(struct dazukofs_container_chunk *);
+}
+
+/**
+ * event_container - get a container of an event
+ * @evt: the event
+ * @i: the index of the container (less than evt->container_count)
+ */
+static inline struct dazukofs_event_container *
+event_container(struct dazukofs_event *evt, int i)
+{
+	return &evt->chunks[i / EC_CHUNK_SIZE]->containers[i % EC_CHUNK_SIZE];
+}
+
+/**
+ * group_set_hash - identify a group at its scanner epoch
+ * @grp: the group (with name and scan_epoch set)
+ *
+ * Description: A new scanner epoch gives the group a new identity, so
+ * verdicts stored for the old epoch no longer match verdict_groups.
+ */
+static u64 group_set_hash(struct dazukofs_group *grp)
+{
+	u32 seed = jhash(&grp->scan_epoch, sizeof(grp->scan_epoch), 0);
+
+	return ((u64)jhash(grp->name, grp->name_length, seed) << 32) |
+	       jhash(grp->name, grp->name_length, seed ^ 1);
+}
 
 /**
  * dazukofs_init_events - initialize event handling infrastructure
@@ -105,12 +357,23 @@ static int last_event_id;
  */
 int dazukofs_init_events(void)
 {
-	mutex_init(&proc_mutex);
-	mutex_init(&work_mutex);
-	init_rwsem(&group_count_sem);
+	int i;
 
-	INIT_LIST_HEAD(&proc_list.list);
+	for (i = 0; i < PROC_HASH_SIZE; i++) {
+		spin_lock_init(&proc_hash[i].lock);
+		INIT_HLIST_HEAD(&proc_hash[i].head);
+	}
 	INIT_LIST_HEAD(&group_list.list);
+	dazukofs_dedup_init();
+	dazukofs_warm_init();
+
+	if (dazukofs_persist_init() != 0)
+		return -ENOMEM;
+
+	group_table = kcalloc(dazukofs_max_groups,
+			      sizeof(struct dazukofs_group *), GFP_KERNEL);
+	if (!group_table)
+		goto error_out;
 
 	dazukofs_group_cachep =
 		kmem_cache_create("dazukofs_group_cache",
@@ -119,92 +382,283 @@ int dazukofs_init_events(void)
 	if (!dazukofs_group_cachep)
 		goto error_out;
 
-	dazukofs_event_container_cachep =
-		kmem_cache_create("dazukofs_event_container_cache",
-				  sizeof(struct dazukofs_event_container), 0,
-				  SLAB_HWCACHE_ALIGN, NULL);
-	if (!dazukofs_event_container_cachep)
+	dazukofs_event_pool =
+		mempool_create_kmalloc_pool(EVENT_POOL_RESERVE,
+					    event_size(dazukofs_max_groups));
+	if (!dazukofs_event_pool)
 		goto error_out;
 
-	dazukofs_event_cachep =
-		kmem_cache_create("dazukofs_event_cache",
-				  sizeof(struct dazukofs_event), 0,
-				  SLAB_HWCACHE_ALIGN, NULL);
-	if (!dazukofs_event_cachep)
+	dazukofs_chunk_pool =
+		mempool_create_kmalloc_pool(
+			max(EVENT_POOL_RESERVE,
+			    chunk_count(dazukofs_max_groups)),
+			sizeof(struct dazukofs_container_chunk));
+	if (!dazukofs_chunk_pool)
 		goto error_out;
 
+	if (rescan_max) {
+		hot_files = kcalloc(rescan_max, sizeof(*hot_files),
+				    GFP_KERNEL);
+		if (!hot_files)
+			goto error_out;
+
+		/* a single worker, files are checked one at a time */
+		rescan_wq = alloc_workqueue("dazukofs_rescan", WQ_UNBOUND, 1);
+		if (!rescan_wq)
+			goto error_out;
+		INIT_WORK(&rescan_work, rescan_hot_files);
+	}
+
 	return 0;
 
 error_out:
+	kfree(hot_files);
+	hot_files = NULL;
+	if (dazukofs_chunk_pool)
+		mempool_destroy(dazukofs_chunk_pool);
+	if (dazukofs_event_pool)
+		mempool_destroy(dazukofs_event_pool);
+	kfree(group_table);
 	if (dazukofs_group_cachep)
 		kmem_cache_destroy(dazukofs_group_cachep);
-	if (dazukofs_event_container_cachep)
-		kmem_cache_destroy(dazukofs_event_container_cachep);
-	if (dazukofs_event_cachep)
-		kmem_cache_destroy(dazukofs_event_cachep);
+	dazukofs_persist_destroy();
 	return -ENOMEM;
 }
 
 /**
- * release_event - release (and possible free) an event
- * @evt: the event to release
- * @decrement_assigned: flag to signal if the assigned count should be
- *                      decremented (only for registered processes)
- * @deny: flag if file access event should be denied
+ * release_hot_file - drop an inode taken from the hot files
+ * @inode: the inode
+ */
+static void release_hot_file(struct inode *inode)
+{
+	clear_bit(DAZUKOFS_INODE_HOT, &get_inode_private(inode)->flags);
+	iput(inode);
+}
+
+/**
+ * take_hot_file - remove an inode from the hot files to check it again
+ * @i: the slot of the inode
  *
- * Description: This function will decrement the assigned count for the
- * event. The "decrement_assigned" flag is used to distinguish between
- * the anonymous process accessing a file and the registered process. The
- * assigned count is only incremented for registered process (although the
- * anonymous process will also have a handle to the event).
+ * Description: The superblock of the inode is remembered until
+ * finish_hot_file() is called, so that it is not shut down meanwhile.
  *
- * For the anonymous process (decrement_assigned = false):
- * If the assigned count is not zero, there are registered processes that
- * have a handle to this event. The event is marked deprecated. Otherwise
- * we free the event.
+ * Returns the inode (with its reference) or NULL if the slot was unused.
+ */
+static struct inode *take_hot_file(unsigned int i)
+{
+	struct inode *inode;
+
+	spin_lock(&hot_lock);
+	inode = hot_files[i];
+	hot_files[i] = NULL;
+	if (inode) {
+		rescan_sb = inode->i_sb;
+		rescan_abort = 0;
+	}
+	spin_unlock(&hot_lock);
+
+	return inode;
+}
+
+/**
+ * finish_hot_file - release an inode that was checked again
+ * @inode: the inode returned by take_hot_file()
+ */
+static void finish_hot_file(struct inode *inode)
+{
+	release_hot_file(inode);
+
+	spin_lock(&hot_lock);
+	rescan_sb = NULL;
+	spin_unlock(&hot_lock);
+
+	wake_up_all(&rescan_idle);
+}
+
+/**
+ * record_hot_file - remember a file that is accessed again
+ * @inode: the inode associated with the file access
  *
- * For a registered process (decrement_assigned = true):
- * The assigned count is decremented. If it is now zero and the event is
- * not deprecated, then the anonymous process still has a handle. In this
- * case we wake the anonymous process. Otherwise we free the event.
+ * Description: This is called for accesses with a cached allow verdict,
+ * so an inode that is already hot is only checked with test_bit(). The
+ * oldest hot file is dropped if all slots are used.
+ */
+static void record_hot_file(struct inode *inode)
+{
+	struct dazukofs_inode_info *dii;
+	struct inode *old;
+
+	if (!hot_files)
+		return;
+
+	dii = get_inode_private(inode);
+	if (test_bit(DAZUKOFS_INODE_HOT, &dii->flags) ||
+	    test_and_set_bit(DAZUKOFS_INODE_HOT, &dii->flags))
+		return;
+
+	/* the opener holds a reference */
+	ihold(inode);
+
+	spin_lock(&hot_lock);
+	old = hot_files[hot_next];
+	hot_files[hot_next] = inode;
+	hot_next = (hot_next + 1) % rescan_max;
+	spin_unlock(&hot_lock);
+
+	if (old)
+		release_hot_file(old);
+}
+
+/**
+ * dazukofs_drop_hot_files - forget the hot files of a superblock
+ * @sb: the superblock being shut down
  *
- * Aside from releasing the event, the deny status of the event is also
- * updated. The "normal" release process involves the registered processes
- * first releasing (and providing their deny values) and finally the
- * anonymous process will release (and free) the event after reading the
- * deny value.
+ * Description: This is called before the inodes of @sb are evicted. No
+ * file of @sb can be accessed (and become hot) anymore. A check of one of
+ * its files that is still running is given up and waited for.
  */
-static void release_event(struct dazukofs_event *evt, int decrement_assigned,
-			  int deny)
+void dazukofs_drop_hot_files(struct super_block *sb)
 {
-	int free_event = 0;
+	struct inode *inode;
+	unsigned int i;
 
-	mutex_lock(&evt->assigned_mutex);
-	if (deny)
-		evt->deny |= 1;
-
-	if (decrement_assigned) {
-		evt->assigned--;
-		if (evt->assigned == 0) {
-			if (!evt->deprecated)
-				wake_up(&evt->queue);
-			else
-				free_event = 1;
-		}
-	} else {
-		if (evt->assigned == 0)
-			free_event = 1;
+	if (!hot_files)
+		return;
+
+	for (i = 0; i < rescan_max; i++) {
+		spin_lock(&hot_lock);
+		inode = hot_files[i];
+		if (inode && inode->i_sb == sb)
+			hot_files[i] = NULL;
 		else
-			evt->deprecated = 1;
+			inode = NULL;
+		spin_unlock(&hot_lock);
+
+		if (inode)
+			release_hot_file(inode);
 	}
-	mutex_unlock(&evt->assigned_mutex);
 
-	if (free_event) {
-		dput(evt->dentry);
-		mntput(evt->mnt);
-		put_pid(evt->proc_id);
-		kmem_cache_free(dazukofs_event_cachep, evt);
+	spin_lock(&hot_lock);
+	if (rescan_sb == sb)
+		rescan_abort = 1;
+	spin_unlock(&hot_lock);
+
+	wait_event(rescan_idle, ACCESS_ONCE(rescan_sb) != sb);
+}
+
+/**
+ * put_event - drop a reference to an event
+ * @evt: the event
+ *
+ * Description: The event is freed when the last reference is dropped.
+ */
+static void put_event(struct dazukofs_event *evt)
+{
+	struct dazukofs_container_chunk *chunk;
+	int i;
+
+	if (!atomic_dec_and_test(&evt->refcount))
+		return;
+
+	dput(evt->dentry);
+	mntput(evt->mnt);
+	put_pid(evt->proc_id);
+
+	/* the first chunk is part of the event */
+	for (i = 1; i < chunk_count(evt->container_count); i++) {
+		chunk = evt->chunks[i];
+		if (chunk->from_pool)
+			mempool_free(chunk, dazukofs_chunk_pool);
+		else
+			kfree(chunk);
 	}
+
+	if (evt->from_pool)
+		mempool_free(evt, dazukofs_event_pool);
+	else
+		kfree(evt);
+}
+
+/**
+ * record_async_verdict - remember the verdict of an asynchronous event
+ * @evt: the completed event
+ *
+ * Description: The opener has already been allowed access. A deny is
+ * remembered for the inode, so that later accesses are denied until the
+ * file is modified (or the set of groups changes).
+ */
+static void record_async_verdict(struct dazukofs_event *evt)
+{
+	struct inode *inode = evt->dentry->d_inode;
+
+	/* default answers are not remembered */
+	if (evt->unchecked)
+		return;
+
+	dazukofs_cache_store(inode, &evt->ticket,
+			     evt->deny ? VERDICT_DENY : VERDICT_ALLOW);
+}
+
+/**
+ * event_verdict - record the answer of a group
+ * @evt: the event
+ * @deny: flag if file access event should be denied
+ *
+ * Description: This is called once for every group the event was assigned
+ * to. When the last group has answered, the waiting processes are woken
+ * or, if nobody waits, the verdict is recorded. The caller must
+ * still drop its reference with put_event().
+ */
+static void event_verdict(struct dazukofs_event *evt, int deny)
+{
+	if (deny)
+		evt->deny = 1;
+
+	/* atomic_dec_and_test() implies a memory barrier for evt->deny */
+	if (!atomic_dec_and_test(&evt->assigned))
+		return;
+
+	/* all processes sharing the event are woken */
+	if (evt->async)
+		record_async_verdict(evt);
+	else
+		complete_all(&evt->done);
+}
+
+/**
+ * resolve_container - give the answer of a group
+ * @ec: the container of the group
+ * @deny: flag if file access event should be denied
+ *
+ * Description: Only the first answer for a container is given to the
+ * event. Later answers (after a timeout) are ignored. Answers of
+ * notification groups are never given to the event.
+ *
+ * Returns 1 if the answer was given, 0 if the container was already
+ * resolved.
+ */
+static int resolve_container(struct dazukofs_event_container *ec, int deny)
+{
+	if (test_and_set_bit(EC_RESOLVED, &ec->flags))
+		return 0;
+
+	/* notification groups do not take part in the verdict */
+	if (!ec->notify)
+		event_verdict(ec->event, deny);
+	return 1;
+}
+
+/**
+ * release_container - release an event container of a removed group
+ * @ec: the container
+ *
+ * Description: The group's answer is "allow" (unless it has already
+ * answered). The container is freed together with its event.
+ */
+static void release_container(struct dazukofs_event_container *ec)
+{
+	resolve_container(ec, 0);
+	put_event(ec->event);
 }
 
 /**
@@ -215,21 +669,33 @@ static void release_event(struct dazukofs_event *evt, int decrement_assigned,
  * for the given event list. The event list will be an empty (yet still
  * valid) list after this function is finished.
  *
- * IMPORTANT: This function requires work_mutex to be held!
+ * IMPORTANT: The event list must not be reachable by other processes
+ *            (for example, it has been spliced from a group list).
  */
 static void __clear_group_event_list(struct list_head *event_list)
 {
 	struct dazukofs_event_container *ec;
-	struct list_head *pos;
-	struct list_head *q;
-
-	list_for_each_safe(pos, q, event_list) {
-		ec = list_entry(pos, struct dazukofs_event_container, list);
-		list_del(pos);
+	struct dazukofs_event_container *tmp;
 
-		release_event(ec->event, 1, 0);
+	list_for_each_entry_safe(ec, tmp, event_list, list) {
+		list_del(&ec->list);
+		release_container(ec);
+	}
+}
 
-		kmem_cache_free(dazukofs_event_container_cachep, ec);
+/**
+ * put_group - stop using a group
+ * @grp: the group returned by get_group()
+ *
+ * Description: The group is freed when the last user is gone. This can
+ * only happen after the group has been removed.
+ */
+static void put_group(struct dazukofs_group *grp)
+{
+	if (atomic_dec_and_test(&grp->use_count)) {
+		free_percpu(grp->todo);
+		kfree(grp->name);
+		kmem_cache_free(dazukofs_group_cachep, grp);
 	}
 }
 
@@ -237,26 +703,77 @@ static void __clear_group_event_list(struct list_head *event_list)
  * __remove_group - clear all activity associated with the group
  * @grp: the group to clear
  *
- * Description: All pending and in-progress events are released/freed.
- * Any processes waiting on the queue are woken.
+ * Description: The group is unpublished and marked as deprecated. All
+ * pending and in-progress events are released/freed. Any processes
+ * waiting on the queue are woken.
  *
- * The actual group structure is not deleted, but rather marked as
- * deprecated. Deprecated group structures are deleted as new
- * groups are added.
+ * The group structure itself is freed once the last process using it
+ * has called put_group().
  *
- * IMPORTANT: This function requires work_mutex to be held!
+ * IMPORTANT: This function requires group_mutex to be held!
  */
 static void __remove_group(struct dazukofs_group *grp)
 {
-	grp->deprecated = 1;
+	struct dazukofs_todo_queue *q;
+	struct dazukofs_working_bucket *b;
+	struct dazukofs_event_container *ec;
+	struct hlist_node *pos;
+	struct hlist_node *tmp;
+	LIST_HEAD(event_list);
+	int cpu;
+	int i;
+
+	rcu_assign_pointer(group_table[grp->group_id], NULL);
+	list_del_rcu(&grp->list);
 	group_count--;
+	static_key_slow_dec(&groups_active);
+
+	/* notification groups do not change any verdict */
+	if (grp->notify) {
+		notify_count--;
+	} else {
+		atomic64_set(&verdict_groups,
+			     atomic64_read(&verdict_groups) ^ grp->set_hash);
+		dazukofs_cache_new_epoch();
+	}
+
+	/*
+	 * Nobody adds containers to the group after seeing this. The
+	 * queue locks below order it against those that did not see it.
+	 */
+	grp->deprecated = 1;
+
+	/* take the events from the group, they are released without lock */
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(grp->todo, cpu);
+		spin_lock(&q->lock);
+		list_for_each_entry(ec, &q->list, list)
+			ec->where = EC_NONE;
+		list_splice_init(&q->list, &event_list);
+		spin_unlock(&q->lock);
+	}
+	atomic_set(&grp->todo_count, 0);
+
+	for (i = 0; i < WORKING_HASH_SIZE; i++) {
+		b = &grp->working_hash[i];
+		spin_lock(&b->lock);
+		hlist_for_each_entry_safe(ec, pos, tmp, &b->head, hash_node) {
+			hlist_del_init(&ec->hash_node);
+			ec->where = EC_NONE;
+			list_add_tail(&ec->list, &event_list);
+		}
+		spin_unlock(&b->lock);
+	}
 
-	__clear_group_event_list(&grp->working_list.list);
-	__clear_group_event_list(&grp->todo_list.list);
+	__clear_group_event_list(&event_list);
 
 	/* notify all registered process waiting for an event */
 	wake_up_all(&grp->queue);
 	wake_up_all(&grp->poll_queue);
+
+	/* wait for lockless readers before dropping the registry reference */
+	synchronize_rcu();
+	put_group(grp);
 }
 
 /**
@@ -267,33 +784,29 @@ static void __remove_group(struct dazukofs_group *grp)
 void dazukofs_destroy_events(void)
 {
 	struct dazukofs_group *grp;
-	struct list_head *pos;
-	struct list_head *q;
+	struct dazukofs_group *tmp;
 
 	/*
-	 * We are not using any locks here because we assume
-	 * everything else has been already cleaned up by
-	 * the device layer.
+	 * Everything else has been already cleaned up by the device
+	 * layer. The mutex is only taken for __remove_group().
 	 */
 
 	/* free the groups */
-	list_for_each_safe(pos, q, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		list_del(pos);
-
+	mutex_lock(&group_mutex);
+	list_for_each_entry_safe(grp, tmp, &group_list.list, list)
 		__remove_group(grp);
-
-		/* free group name */
-		kfree(grp->name);
-
-		/* free group */
-		kmem_cache_free(dazukofs_group_cachep, grp);
-	}
+	mutex_unlock(&group_mutex);
 
 	/* free everything else */
+	if (rescan_wq)
+		destroy_workqueue(rescan_wq);
+	kfree(hot_files);
+	kfree(group_table);
 	kmem_cache_destroy(dazukofs_group_cachep);
-	kmem_cache_destroy(dazukofs_event_container_cachep);
-	kmem_cache_destroy(dazukofs_event_cachep);
+	mempool_destroy(dazukofs_chunk_pool);
+	mempool_destroy(dazukofs_event_pool);
+	dazukofs_persist_destroy();
+	dazukofs_warm_destroy();
 }
 
 /**
@@ -314,9 +827,9 @@ void dazukofs_destroy_events(void)
  * NOTE: Although the function name may imply read-only, this function
  *       _will_ set a group to track if the group is found to exist and
  *       tracking should be set. We do this because it is convenient
- *       since the work_mutex is already locked.
+ *       since the group_mutex is already locked.
  *
- * IMPORTANT: This function requires work_mutex to be held!
+ * IMPORTANT: This function requires group_mutex to be held!
  *
  * Returns 0 if the group exists or may be created.
  */
@@ -324,31 +837,19 @@ static int __check_for_group(const char *name, int id, int track,
 			     int *already_exists)
 {
 	struct dazukofs_group *grp;
-	struct list_head *pos;
-	struct list_head *q;
 	int id_available = 1;
 
 	*already_exists = 0;
 
-	list_for_each_safe(pos, q, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (grp->deprecated) {
-			/* cleanup deprecated groups */
-			if (atomic_read(&grp->use_count) == 0) {
-				list_del(pos);
-				kfree(grp->name);
-				kmem_cache_free(dazukofs_group_cachep, grp);
-			}
-		} else {
-			if (strcmp(name, grp->name) == 0) {
-				*already_exists = 1;
-				if (track)
-					grp->tracking = 1;
-				break;
-			} else if (grp->group_id == id) {
-				id_available = 0;
-				break;
-			}
+	list_for_each_entry(grp, &group_list.list, list) {
+		if (strcmp(name, grp->name) == 0) {
+			*already_exists = 1;
+			if (track)
+				grp->tracking = 1;
+			break;
+		} else if (grp->group_id == id) {
+			id_available = 0;
+			break;
 		}
 	}
 
@@ -370,7 +871,7 @@ static int __check_for_group(const char *name, int id, int track,
  * @track: flag set if tracking is to be used
  *
  * Description: This function allocates and initializes a group
- * structure. The group_count should be locked to ensure that
+ * structure. The group_mutex should be locked to ensure that
  * the group id remains available until the group can be
  * added to the group list.
  *
@@ -379,13 +880,17 @@ static int __check_for_group(const char *name, int id, int track,
 static struct dazukofs_group *__create_group(const char *name, int id,
 					     int track)
 {
+	struct dazukofs_todo_queue *q;
 	struct dazukofs_group *grp;
+	int cpu;
+	int i;
 
 	grp = kmem_cache_zalloc(dazukofs_group_cachep, GFP_KERNEL);
 	if (!grp)
 		return NULL;
 
-	atomic_set(&grp->use_count, 0);
+	/* the reference of the registry */
+	atomic_set(&grp->use_count, 1);
 	grp->group_id = id;
 	grp->name = kstrdup(name, GFP_KERNEL);
 	if (!grp->name) {
@@ -393,10 +898,25 @@ static struct dazukofs_group *__create_group(const char *name, int id,
 		return NULL;
 	}
 	grp->name_length = strlen(name);
+	grp->set_hash = group_set_hash(grp);
+	grp->todo = alloc_percpu(struct dazukofs_todo_queue);
+	if (!grp->todo) {
+		kfree(grp->name);
+		kmem_cache_free(dazukofs_group_cachep, grp);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(grp->todo, cpu);
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->list);
+	}
+	atomic_set(&grp->todo_count, 0);
 	init_waitqueue_head(&grp->queue);
 	init_waitqueue_head(&grp->poll_queue);
-	INIT_LIST_HEAD(&grp->todo_list.list);
-	INIT_LIST_HEAD(&grp->working_list.list);
+	for (i = 0; i < WORKING_HASH_SIZE; i++) {
+		spin_lock_init(&grp->working_hash[i].lock);
+		INIT_HLIST_HEAD(&grp->working_hash[i].head);
+	}
 	if (track)
 		grp->tracking = 1;
 	return grp;
@@ -405,7 +925,8 @@ static struct dazukofs_group *__create_group(const char *name, int id,
 /**
  * dazukofs_add_group - add a new group
  * @name: the name of the group to add
- * @track: flag set if tracking is to be used
+ * @flags: DAZUKOFS_GROUP_TRACK if tracking is to be used,
+ *	   DAZUKOFS_GROUP_NOTIFY for a notification group
  *
  * Description: This function is called by the device layer to add a new
  * group. It returns success if the group has been successfully created
@@ -413,26 +934,26 @@ static struct dazukofs_group *__create_group(const char *name, int id,
  *
  * If the group already exists and is not tracking, but "track" is set,
  * the group will be changed to start tracking (actually done in the
- * function __check_for_group()).
+ * function __check_for_group()). An existing group does not change
+ * between blocking and notification.
  *
  * Returns 0 on success.
  */
-int dazukofs_add_group(const char *name, int track)
+int dazukofs_add_group(const char *name, int flags)
 {
 	int ret = 0;
 	int already_exists;
 	int available_id = 0;
+	int track = flags & DAZUKOFS_GROUP_TRACK;
 	struct dazukofs_group *grp;
 
-	down_write(&group_count_sem);
+	mutex_lock(&group_mutex);
 
-	mutex_lock(&work_mutex);
 	while (__check_for_group(name, available_id, track,
 				 &already_exists) != 0) {
 		/* try again with the next id */
 		available_id++;
 	}
-	mutex_unlock(&work_mutex);
 
 	if (already_exists)
 		goto out;
@@ -440,7 +961,7 @@ int dazukofs_add_group(const char *name, int track)
 	/* if we are here, the group doesn't already exist */
 
 	/* do we have room for a new group? */
-	if (group_count == GROUP_COUNT) {
+	if (group_count == dazukofs_max_groups) {
 		ret = -EPERM;
 		goto out;
 	}
@@ -450,14 +971,27 @@ int dazukofs_add_group(const char *name, int track)
 		ret = -ENOMEM;
 		goto out;
 	}
+	if (flags & DAZUKOFS_GROUP_NOTIFY)
+		grp->notify = 1;
 
-	mutex_lock(&work_mutex);
-	list_add_tail(&grp->list, &group_list.list);
-	mutex_unlock(&work_mutex);
+	list_add_tail_rcu(&grp->list, &group_list.list);
+	rcu_assign_pointer(group_table[available_id], grp);
 
 	group_count++;
+	static_key_slow_inc(&groups_active);
+
+	if (grp->notify) {
+		/* notification groups also see files with cached verdicts */
+		notify_count++;
+	} else {
+		atomic64_set(&verdict_groups,
+			     atomic64_read(&verdict_groups) ^ grp->set_hash);
+
+		/* the new group has not seen any files yet */
+		dazukofs_cache_new_epoch();
+	}
 out:
-	up_write(&group_count_sem);
+	mutex_unlock(&group_mutex);
 	return ret;
 }
 
@@ -478,25 +1012,49 @@ int dazukofs_remove_group(const char *name, int unused)
 {
 	int ret = 0;
 	struct dazukofs_group *grp;
-	struct list_head *pos;
 
-	down_write(&group_count_sem);
+	mutex_lock(&group_mutex);
 
-	if (group_count == 0)
-		goto out;
-
-	mutex_lock(&work_mutex);
-	/* set group deprecated */
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated && strcmp(name, grp->name) == 0) {
+	list_for_each_entry(grp, &group_list.list, list) {
+		if (strcmp(name, grp->name) == 0) {
 			__remove_group(grp);
 			break;
 		}
 	}
-	mutex_unlock(&work_mutex);
-out:
-	up_write(&group_count_sem);
+
+	mutex_unlock(&group_mutex);
+	return ret;
+}
+
+/**
+ * dazukofs_set_group_timeout - set the default answer of a group
+ * @name: the name of the group
+ * @msecs: the time a group has to answer (0 to wait forever)
+ * @deny: flag if file access should be denied when the time is up
+ *
+ * Description: The timeout applies to events that are posted after it
+ * has been set.
+ *
+ * Returns 0 on success or -EINVAL if the group does not exist.
+ */
+int dazukofs_set_group_timeout(const char *name, unsigned int msecs,
+			       int deny)
+{
+	int ret = -EINVAL;
+	struct dazukofs_group *grp;
+
+	mutex_lock(&group_mutex);
+
+	list_for_each_entry(grp, &group_list.list, list) {
+		if (strcmp(name, grp->name) == 0) {
+			grp->timeout_deny = deny;
+			grp->timeout = msecs_to_jiffies(msecs);
+			ret = 0;
+			break;
+		}
+	}
+
+	mutex_unlock(&group_mutex);
 	return ret;
 }
 
@@ -516,7 +1074,6 @@ int dazukofs_get_groups(char **buf)
 {
 	struct dazukofs_group *grp;
 	char *tmp;
-	struct list_head *pos;
 	size_t buflen;
 	size_t allocsize = 256;
 
@@ -527,25 +1084,21 @@ tryagain:
 	tmp = *buf;
 	buflen = 1;
 
-	mutex_lock(&work_mutex);
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated)
-			buflen += grp->name_length + 3;
+	mutex_lock(&group_mutex);
+	list_for_each_entry(grp, &group_list.list, list) {
+		/* the group id may have several digits */
+		buflen += snprintf(NULL, 0, "%lu:%s\n", grp->group_id,
+				   grp->name);
 	}
 	if (buflen < allocsize) {
-		list_for_each(pos, &group_list.list) {
-			grp = list_entry(pos, struct dazukofs_group, list);
-			if (!grp->deprecated) {
-				snprintf(tmp, (allocsize - 1) - (tmp - *buf),
-					 "%lu:%s\n", grp->group_id,
-					 grp->name);
-				tmp += grp->name_length + 3;
-			}
+		list_for_each_entry(grp, &group_list.list, list) {
+			tmp += snprintf(tmp, (allocsize - 1) - (tmp - *buf),
+					"%lu:%s\n", grp->group_id,
+					grp->name);
 		}
-		mutex_unlock(&work_mutex);
+		mutex_unlock(&group_mutex);
 	} else {
-		mutex_unlock(&work_mutex);
+		mutex_unlock(&group_mutex);
 		allocsize *= 2;
 		kfree(*buf);
 		goto tryagain;
@@ -554,66 +1107,54 @@ tryagain:
 	return 0;
 }
 
+static struct dazukofs_proc_bucket *proc_hash_bucket(struct task_struct *task)
+{
+	return &proc_hash[hash_ptr(task, PROC_HASH_BITS)];
+}
+
 /**
  * check_recursion - check if current process is recursing
  *
- * Description: A list of anonymous processes is managed to prevent
+ * Description: A hash of anonymous processes is managed to prevent
  * access event recursion. This function checks if the current process is
- * a part of that list.
+ * a part of that hash. If no process is masked, no lock is taken.
  *
- * If the current process is found in the process list, it is removed.
+ * If the current process is found in the process hash, it is removed.
  *
  * NOTE: The proc structure is not freed. It is only removed from the
- *       list. Since it is a recursive call, the caller can free the
+ *       hash. Since it is a recursive call, the caller can free the
  *       structure after the call chain is finished.
  *
  * Returns 0 if this is a recursive process call.
  */
 static int check_recursion(void)
 {
+	struct dazukofs_proc_bucket *bucket;
 	struct dazukofs_proc *proc;
-	struct list_head *pos;
+	struct hlist_node *pos;
 	int found = 0;
-	struct pid *cur_proc_id = get_pid(task_pid(current));
 
-	mutex_lock(&proc_mutex);
-	list_for_each(pos, &proc_list.list) {
-		proc = list_entry(pos, struct dazukofs_proc, list);
-		if (proc->proc_id == cur_proc_id) {
-			found = 1;
-			list_del(pos);
+	if (atomic_read(&proc_count) == 0)
+		return 1;
+
+	bucket = proc_hash_bucket(current);
+
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(proc, pos, &bucket->head, hash_node) {
+		if (proc->task == current) {
+			found = 1;
+			hlist_del(&proc->hash_node);
 			proc->within_list = 0;
-			put_pid(proc->proc_id);
+			atomic_dec(&proc_count);
 			break;
 		}
 	}
-	mutex_unlock(&proc_mutex);
-
-	put_pid(cur_proc_id);
+	spin_unlock(&bucket->lock);
 
 	/* process event if not found */
 	return !found;
 }
 
-/**
- * event_assigned - check if event is (still) assigned
- * @event: event to check
- *
- * Description: This function checks if an event is still assigned. An
- * assigned event means that it is sitting on the todo or working list
- * of a group.
- *
- * Returns the number assigned count.
- */
-static int event_assigned(struct dazukofs_event *event)
-{
-	int val;
-	mutex_lock(&event->assigned_mutex);
-	val = event->assigned;
-	mutex_unlock(&event->assigned_mutex);
-	return val;
-}
-
 /**
  * check_access_precheck - check if an access event should be generated
  * @grp_count: the current number of groups
@@ -640,97 +1181,614 @@ static int check_access_precheck(int grp_count)
 	return 0;
 }
 
+/**
+ * wake_group - wake registered processes for new events
+ * @grp: the group
+ * @nr: the number of new events on the todo list
+ * @was_empty: flag set if the todo list was empty before
+ *
+ * Description: Processes waiting in dazukofs_get_event() wait exclusively,
+ * so only one of them is woken per event. Poll waiters cannot wait
+ * exclusively (EPOLLEXCLUSIVE does not exist for this kernel), so they are
+ * only woken when the todo list becomes non-empty. This is enough for
+ * poll(), which is level triggered.
+ */
+static void wake_group(struct dazukofs_group *grp, int nr, int was_empty)
+{
+	wake_up_nr(&grp->queue, nr);
+
+	if (was_empty)
+		wake_up(&grp->poll_queue);
+}
+
+/* a degraded group is tripped by this many missed deadlines in a row */
+#define BREAKER_MISSES	3
+
+/* ... or by this many queued events */
+#define BREAKER_BACKLOG	4096
+
+/**
+ * trip_group - put a group into degraded mode
+ * @grp: the group (with a timeout)
+ *
+ * Description: New events are not queued for a degraded group. They get
+ * the group's default answer instead.
+ */
+static void trip_group(struct dazukofs_group *grp)
+{
+	if (xchg(&grp->degraded, 1))
+		return;
+
+	printk(KERN_WARNING "dazukofs: group %s is not keeping up, "
+	       "file access is %s\n", grp->name,
+	       grp->timeout_deny ? "denied" : "allowed");
+}
+
+/**
+ * check_group_recovery - end the degraded mode of a group
+ * @grp: the group
+ *
+ * Description: This is called when a registered process of the group
+ * looks for work. Once the backlog has been drained, events are queued
+ * for the group again.
+ */
+static void check_group_recovery(struct dazukofs_group *grp)
+{
+	if (!ACCESS_ONCE(grp->degraded) ||
+	    atomic_read(&grp->todo_count) != 0)
+		return;
+
+	atomic_set(&grp->misses, 0);
+	if (xchg(&grp->degraded, 0))
+		printk(KERN_INFO "dazukofs: group %s has recovered\n",
+		       grp->name);
+}
+
+/**
+ * working_bucket - get the working hash bucket for an event id
+ * @grp: the group
+ * @event_id: the event id
+ *
+ * Returns the bucket that a claimed event with the given id is stored in.
+ */
+static struct dazukofs_working_bucket *
+working_bucket(struct dazukofs_group *grp, unsigned long event_id)
+{
+	return &grp->working_hash[hash_long(event_id, WORKING_HASH_BITS)];
+}
+
+/**
+ * enqueue_event - put an event container on a todo queue of a group
+ * @grp: the group
+ * @ec: the event container (owned by the caller)
+ * @head: flag set if the event should be the next one handled
+ *
+ * Description: The container is put on the todo queue of the current cpu
+ * and the group is woken.
+ *
+ * Returns 0 if the container was queued. If the group has been removed
+ * or the container has been resolved (timed out), -EINVAL is returned and
+ * the caller still owns the container.
+ */
+static int enqueue_event(struct dazukofs_group *grp,
+			 struct dazukofs_event_container *ec, int head)
+{
+	struct dazukofs_todo_queue *q;
+	int count;
+
+	/* this is only a hint, so migrating meanwhile does not matter */
+	q = per_cpu_ptr(grp->todo, raw_smp_processor_id());
+
+	spin_lock(&q->lock);
+	if (grp->deprecated) {
+		spin_unlock(&q->lock);
+		return -EINVAL;
+	}
+
+	/* pairs with the barrier in resolve_container() of the opener */
+	ec->queue = q;
+	ec->where = EC_TODO;
+	smp_mb();
+	if (test_bit(EC_RESOLVED, &ec->flags)) {
+		ec->where = EC_NONE;
+		spin_unlock(&q->lock);
+		return -EINVAL;
+	}
+
+	if (head)
+		list_add(&ec->list, &q->list);
+	else
+		list_add_tail(&ec->list, &q->list);
+	count = atomic_inc_return(&grp->todo_count);
+	spin_unlock(&q->lock);
+
+	if (grp->timeout && count > BREAKER_BACKLOG)
+		trip_group(grp);
+
+	/* notify someone to handle the event */
+	wake_group(grp, 1, count == 1);
+
+	return 0;
+}
+
 /**
  * assign_event_to_groups - post an event to be processed
  * @evt: the event to be posted
- * @ec_array: the containers for the event
  *
  * Description: This function will assign a unique id to the event.
- * The event will be associated with each container and the container is
- * placed on each group's todo list. Each group will also be woken to
- * handle the new event.
+ * One of the event's containers is placed on a todo queue of each group
+ * (only of the notification groups if evt->notify_only is set). Each group
+ * will also be woken to handle the new event. Only blocking groups are
+ * counted in evt->assigned.
+ *
+ * If there are more active groups than containers, nothing is assigned.
+ *
+ * Returns the number of active groups.
  */
-static void
-assign_event_to_groups(struct dazukofs_event *evt,
-		       struct dazukofs_event_container *ec_array[])
+static int assign_event_to_groups(struct dazukofs_event *evt)
 {
+	struct dazukofs_event_container *ec;
 	struct dazukofs_group *grp;
-	struct list_head *pos;
-	int i;
+	int grp_count = 0;
+	int i = 0;
 
-	mutex_lock(&work_mutex);
-	mutex_lock(&evt->assigned_mutex);
+	rcu_read_lock();
 
-	/* assign the event a "unique" id */
+	list_for_each_entry_rcu(grp, &group_list.list, list)
+		grp_count++;
+
+	if (grp_count > evt->container_count)
+		goto out;
 
-	last_event_id++;
-	evt->event_id = last_event_id;
+	/* assign the event a "unique" id */
+	evt->event_id = (unsigned long)atomic_long_inc_return(&last_event_id);
 
 	/* assign the event to each group */
-	i = 0;
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated) {
-			ec_array[i]->event = evt;
+	list_for_each_entry_rcu(grp, &group_list.list, list) {
+		/* a group may have been added since counting */
+		if (i == evt->container_count)
+			break;
 
-			evt->assigned++;
-			list_add_tail(&ec_array[i]->list,
-				      &grp->todo_list.list);
+		if (evt->notify_only && !grp->notify)
+			continue;
 
-			/* notify someone to handle the event */
-			wake_up(&grp->queue);
-			wake_up(&grp->poll_queue);
+		if (grp->notify) {
+			/* nobody waits for notification groups, so
+			 * their backlog must be bounded */
+			if (atomic_read(&grp->todo_count) >= BREAKER_BACKLOG) {
+				atomic_long_inc(&grp->bypassed);
+				continue;
+			}
+		} else if (ACCESS_ONCE(grp->degraded)) {
+			/* the group's scanners are not keeping up */
+			if (grp->timeout_deny)
+				evt->deny = 1;
+			evt->unchecked = 1;
+			atomic_long_inc(&grp->bypassed);
+			continue;
+		}
 
-			i++;
+		ec = event_container(evt, i);
+		ec->event = evt;
+		ec->grp = grp;
+		ec->notify = grp->notify;
+		ec->deadline = 0;
+
+		/* 0 means no deadline, so it is never used as one */
+		if (grp->timeout && !ec->notify) {
+			ec->deadline = (jiffies + grp->timeout) | 1;
+			ec->timeout_deny = grp->timeout_deny;
+		}
+
+		/* the group may answer as soon as the event is queued */
+		if (!ec->notify) {
+			evt->groups ^= grp->set_hash;
+			atomic_inc(&evt->assigned);
+		}
+		atomic_inc(&evt->refcount);
+
+		if (enqueue_event(grp, ec, 0) != 0) {
+			/* the group was removed meanwhile (the opener's
+			 * references keep both counts above zero) */
+			if (!ec->notify)
+				atomic_dec(&evt->assigned);
+			atomic_dec(&evt->refcount);
+			ec->deadline = 0;
+			continue;
 		}
+		i++;
 	}
+out:
+	rcu_read_unlock();
 
-	mutex_unlock(&evt->assigned_mutex);
-	mutex_unlock(&work_mutex);
+	return grp_count;
 }
 
 /**
- * allocate_event_and_containers - allocate an event and event containers
- * @evt: event pointer to be assigned a new event
- * @ec: event container array to be filled with new array of containers
- * @grp_count: the number of groups (size of the array)
+ * allocate_event - allocate an event
+ * @container_count: the number of containers (groups) needed
+ * @reserve_ok: whether the reserved pools may be used
  *
- * Description: New event and event container structures are allocated
- * and initialized.
+ * Description: The event includes the first EC_CHUNK_SIZE containers,
+ * further containers are allocated in chunks. If memory is tight, the
+ * event and chunks are taken from reserved pools (possibly waiting for
+ * other events to be freed), so this function does not fail. Events that
+ * nobody waits for may stay queued for a long time and would use up the
+ * reserve, so they are not allowed to use it.
  *
- * Returns 0 on success.
+ * Returns the new event or NULL if @reserve_ok is not set and memory is
+ * tight.
  */
-static int
-allocate_event_and_containers(struct dazukofs_event **evt,
-			      struct dazukofs_event_container *ec_array[],
-			      int grp_count)
+static struct dazukofs_event *allocate_event(int container_count,
+					     int reserve_ok)
 {
+	struct dazukofs_event *evt;
+	struct dazukofs_container_chunk *chunk;
+	size_t size = event_size(container_count);
+	int reserve = 0;
 	int i;
 
-	*evt = kmem_cache_zalloc(dazukofs_event_cachep, GFP_KERNEL);
-	if (!*evt)
-		return -1;
-	init_waitqueue_head(&(*evt)->queue);
-	mutex_init(&(*evt)->assigned_mutex);
-
-	/* allocate containers now while we don't have a lock */
-	for (i = 0; i < grp_count; i++) {
-		ec_array[i] = kmem_cache_zalloc(
-				dazukofs_event_container_cachep, GFP_KERNEL);
-		if (!ec_array[i])
-			goto error_out;
+	evt = kmalloc(size, GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+	if (evt) {
+		memset(evt, 0, size);
+	} else {
+		if (!reserve_ok)
+			return NULL;
+		mutex_lock(&event_pool_mutex);
+		reserve = 1;
+		evt = mempool_alloc(dazukofs_event_pool, GFP_KERNEL);
+		memset(evt, 0, size);
+		evt->from_pool = 1;
 	}
 
-	return 0;
+	evt->chunks[0] = &evt->first_chunk;
+	for (i = 1; i < chunk_count(container_count); i++) {
+		chunk = kzalloc(sizeof(*chunk),
+				GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+		if (!chunk) {
+			if (!reserve_ok)
+				goto error_out;
+			if (!reserve) {
+				mutex_lock(&event_pool_mutex);
+				reserve = 1;
+			}
+			chunk = mempool_alloc(dazukofs_chunk_pool, GFP_KERNEL);
+			memset(chunk, 0, sizeof(*chunk));
+			chunk->from_pool = 1;
+		}
+		evt->chunks[i] = chunk;
+	}
+
+	if (reserve)
+		mutex_unlock(&event_pool_mutex);
+
+	evt->container_count = container_count;
+	init_completion(&evt->done);
+
+	/* the opener holds a reference and keeps the event from completing
+	 * until it is assigned to all groups */
+	atomic_set(&evt->assigned, 1);
+	atomic_set(&evt->refcount, 1);
+
+	return evt;
 
 error_out:
-	for (i--; i >= 0; i--) {
-		kmem_cache_free(dazukofs_event_container_cachep, ec_array[i]);
-		ec_array[i] = NULL;
+	/* nothing was taken from the reserved pools */
+	while (--i > 0)
+		kfree(evt->chunks[i]);
+	kfree(evt);
+	return NULL;
+}
+
+/**
+ * remove_container - take a resolved container from its group
+ * @ec: the container (resolved by the caller)
+ *
+ * Description: The container is taken from the todo queue or working hash
+ * it is on, so the group does not keep the event alive. If the container
+ * is currently being moved, the mover releases it instead.
+ *
+ * IMPORTANT: This function requires rcu_read_lock() to be held, which
+ *            keeps the group from being freed!
+ */
+static void remove_container(struct dazukofs_event_container *ec)
+{
+	struct dazukofs_todo_queue *q;
+	struct dazukofs_working_bucket *b;
+
+	for (;;) {
+		switch (ACCESS_ONCE(ec->where)) {
+		case EC_TODO:
+			q = ACCESS_ONCE(ec->queue);
+			spin_lock(&q->lock);
+			if (ec->where == EC_TODO && ec->queue == q) {
+				list_del_init(&ec->list);
+				ec->where = EC_NONE;
+				atomic_dec(&ec->grp->todo_count);
+				spin_unlock(&q->lock);
+				put_event(ec->event);
+				return;
+			}
+			spin_unlock(&q->lock);
+			break;
+		case EC_WORKING:
+			b = working_bucket(ec->grp, ec->event->event_id);
+			spin_lock(&b->lock);
+			if (ec->where == EC_WORKING) {
+				hlist_del_init(&ec->hash_node);
+				ec->where = EC_NONE;
+				spin_unlock(&b->lock);
+				put_event(ec->event);
+				return;
+			}
+			spin_unlock(&b->lock);
+			break;
+		default:
+			return;
+		}
 	}
-	kmem_cache_free(dazukofs_event_cachep, *evt);
-	*evt = NULL;
-	return -1;
+}
+
+/**
+ * timeout_expired_containers - give the default answers of late groups
+ * @evt: the event
+ *
+ * Description: Each group whose deadline has passed is given its default
+ * answer and the container is taken from the group. The timeout is
+ * counted for the group.
+ */
+static void timeout_expired_containers(struct dazukofs_event *evt)
+{
+	struct dazukofs_event_container *ec;
+	unsigned long now = jiffies;
+	int i;
+
+	rcu_read_lock();
+	for (i = 0; i < evt->container_count; i++) {
+		ec = event_container(evt, i);
+		if (!ec->deadline || time_before(now, ec->deadline))
+			continue;
+
+		/* the group answered in time */
+		if (test_bit(EC_RESOLVED, &ec->flags))
+			continue;
+
+		/* set first, waiters may read it as soon as it resolves */
+		evt->unchecked = 1;
+
+		if (!resolve_container(ec, ec->timeout_deny))
+			continue;
+
+		atomic_long_inc(&ec->grp->timeouts);
+		if (atomic_inc_return(&ec->grp->misses) >= BREAKER_MISSES)
+			trip_group(ec->grp);
+		remove_container(ec);
+	}
+	rcu_read_unlock();
+}
+
+/* how often a wait that may be given up checks whether to give up */
+#define ABORT_POLL	(HZ / 10)
+
+/**
+ * wait_for_verdicts - wait until all groups have answered
+ * @evt: the event (assigned to all groups)
+ * @abort: set to give up waiting (or NULL)
+ *
+ * Description: The opener's assigned bias must already be dropped. The
+ * wait is uninterruptible, but no longer than the earliest deadline of
+ * the groups that have not answered yet. Late groups are given their
+ * default answer. Several processes may wait for the same event.
+ *
+ * Returns 0 if all groups answered or -EINTR if the wait was given up.
+ */
+static int wait_for_verdicts(struct dazukofs_event *evt, const int *abort)
+{
+	struct dazukofs_event_container *ec;
+	unsigned long deadline;
+	unsigned long now;
+	int i;
+
+	for (;;) {
+		deadline = 0;
+		for (i = 0; i < evt->container_count; i++) {
+			ec = event_container(evt, i);
+			if (!ec->deadline ||
+			    test_bit(EC_RESOLVED, &ec->flags))
+				continue;
+			if (!deadline || time_before(ec->deadline, deadline))
+				deadline = ec->deadline;
+		}
+
+		if (abort) {
+			if (ACCESS_ONCE(*abort))
+				return -EINTR;
+			now = jiffies + ABORT_POLL;
+			if (!deadline || time_before(now, deadline))
+				deadline = now ? now : 1;
+		}
+
+		if (!deadline) {
+			wait_for_completion(&evt->done);
+			return 0;
+		}
+
+		now = jiffies;
+		if (time_before(now, deadline) &&
+		    wait_for_completion_timeout(&evt->done, deadline - now))
+			return 0;
+
+		timeout_expired_containers(evt);
+	}
+}
+
+/* how an event is posted */
+#define POST_WAIT	0	/* the opener waits for the verdict */
+#define POST_ASYNC	1	/* nobody waits, the verdict is recorded */
+#define POST_NOTIFY	2	/* only for notification groups */
+
+/**
+ * join_inflight_event - share the event of a concurrent access
+ * @inode: the inode being accessed
+ * @ticket: the state of the inode before the access is checked
+ *
+ * Description: The event is only shared if the inode was not modified
+ * (and the groups did not change) since the event was posted.
+ *
+ * Returns the in-flight event of the inode (with a reference) or NULL.
+ */
+static struct dazukofs_event *
+join_inflight_event(struct inode *inode, struct dazukofs_cache_ticket *ticket)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(inode);
+	struct dazukofs_event *evt;
+
+	spin_lock(&dii->verdict_lock);
+	evt = dii->inflight;
+	if (evt && evt->ticket.change_count == ticket->change_count &&
+	    evt->ticket.epoch == ticket->epoch)
+		atomic_inc(&evt->refcount);
+	else
+		evt = NULL;
+	spin_unlock(&dii->verdict_lock);
+
+	return evt;
+}
+
+/**
+ * set_inflight_event - make an event available to concurrent accesses
+ * @inode: the inode being accessed
+ * @evt: the event (or NULL to remove @old)
+ * @old: the event expected to be in flight
+ *
+ * Description: The pointer does not hold a reference. The event must be
+ * removed before its poster drops its own reference.
+ */
+static void set_inflight_event(struct inode *inode,
+			       struct dazukofs_event *evt,
+			       struct dazukofs_event *old)
+{
+	struct dazukofs_inode_info *dii = get_inode_private(inode);
+
+	spin_lock(&dii->verdict_lock);
+	if (dii->inflight == old)
+		dii->inflight = evt;
+	spin_unlock(&dii->verdict_lock);
+}
+
+/**
+ * post_event - allocate an event and assign it to the groups
+ * @dentry: the dentry associated with the file access
+ * @mnt: the vfsmount associated with the file access
+ * @grp_count: the expected number of groups
+ * @mode: POST_WAIT, POST_ASYNC or POST_NOTIFY
+ * @ticket: the state of the inode (or NULL for POST_NOTIFY)
+ *
+ * Returns the event, which holds a reference of the caller and the
+ * caller's bias in evt->assigned. For POST_ASYNC and POST_NOTIFY, NULL is
+ * returned if memory is tight (nobody waits for these events).
+ */
+static struct dazukofs_event *post_event(struct dentry *dentry,
+					 struct vfsmount *mnt, int grp_count,
+					 int mode,
+					 struct dazukofs_cache_ticket *ticket)
+{
+	struct dazukofs_event *evt;
+
+	for (;;) {
+		/* allocate now while we don't have a lock */
+		evt = allocate_event(grp_count, mode == POST_WAIT);
+		if (!evt)
+			return NULL;
+		evt->dentry = dget(dentry);
+		evt->mnt = mntget(mnt);
+		evt->proc_id = get_pid(task_pid(current));
+		evt->notify_only = (mode == POST_NOTIFY);
+		evt->async = (mode == POST_ASYNC);
+		if (ticket)
+			evt->ticket = *ticket;
+
+		grp_count = assign_event_to_groups(evt);
+		if (grp_count <= evt->container_count)
+			break;
+
+		/* groups were added in the meantime, try again */
+		put_event(evt);
+	}
+
+	return evt;
+}
+
+/**
+ * notify_access - post an event only to the notification groups
+ * @dentry: the dentry associated with the file access
+ * @mnt: the vfsmount associated with the file access
+ * @grp_count: the expected number of groups
+ *
+ * Description: This is used for file accesses that are decided without
+ * asking the groups. Nobody waits for the event, so it is not posted if
+ * memory is tight.
+ */
+static void notify_access(struct dentry *dentry, struct vfsmount *mnt,
+			  int grp_count)
+{
+	struct dazukofs_event *evt;
+
+	if (!ACCESS_ONCE(notify_count))
+		return;
+
+	evt = post_event(dentry, mnt, grp_count, POST_NOTIFY, NULL);
+	if (evt)
+		put_event(evt);
+}
+
+/**
+ * check_with_groups - post an event and wait for its verdict
+ * @dentry: the dentry associated with the file access
+ * @mnt: the vfsmount associated with the file access
+ * @grp_count: the expected number of groups
+ * @ticket: the state of the inode before the access is checked
+ *
+ * Description: Concurrent accesses to the same file may join the event
+ * while it is in flight.
+ *
+ * Returns the completed event (with a reference).
+ */
+static struct dazukofs_event *
+check_with_groups(struct dentry *dentry, struct vfsmount *mnt, int grp_count,
+		  struct dazukofs_cache_ticket *ticket)
+{
+	struct dazukofs_event *evt;
+
+	evt = post_event(dentry, mnt, grp_count, POST_WAIT, ticket);
+	set_inflight_event(dentry->d_inode, evt, NULL);
+
+	/* wait (uninterruptible) until event completely processed */
+	event_verdict(evt, 0);
+	wait_for_verdicts(evt, NULL);
+
+	set_inflight_event(dentry->d_inode, NULL, evt);
+
+	return evt;
+}
+
+/**
+ * store_allow - remember that all groups allowed access to a file
+ * @dentry: the dentry of the checked file
+ * @evt: the completed event
+ *
+ * Description: The verdict is only stored beyond the inode if groups
+ * giving verdicts answered, and only for that set of groups.
+ */
+static void store_allow(struct dentry *dentry, struct dazukofs_event *evt)
+{
+	dazukofs_cache_store(dentry->d_inode, &evt->ticket, VERDICT_ALLOW);
+
+	if (!evt->groups || evt->groups != atomic64_read(&verdict_groups))
+		return;
+
+	dazukofs_persist_store(dentry, &evt->ticket, evt->groups);
+	dazukofs_warm_store(dentry, &evt->ticket, evt->groups);
 }
 
 /**
@@ -739,50 +1797,306 @@ error_out:
  * @mnt: the vfsmount associated with the file access
  *
  * Description: This is the only function used by the stackable filesystem
- * layer to check if a file may be accessed.
+ * layer to check if a file may be accessed. As long as no groups exist,
+ * this function does not touch any shared data (the check is a patched
+ * branch if the kernel supports jump labels).
+ *
+ * Concurrent accesses to the same (unmodified) file share one event and
+ * its verdict.
+ *
+ * Trusted processes (see dazukofs_check_async_process()) are allowed
+ * access immediately. Their event is still checked by the groups and a
+ * deny is remembered for later accesses.
  *
  * Returns 0 if the file access is allowed.
  */
 int dazukofs_check_access(struct dentry *dentry, struct vfsmount *mnt)
 {
-	struct dazukofs_event_container *ec_array[GROUP_COUNT];
 	struct dazukofs_event *evt;
+	struct dazukofs_cache_ticket ticket;
+	u64 groups;
+	int grp_count;
+	int deny;
 	int err = 0;
 
-	down_read(&group_count_sem);
+	if (!static_key_false(&groups_active))
+		return 0;
+
+	grp_count = ACCESS_ONCE(group_count);
 
-	if (check_access_precheck(group_count)) {
-		up_read(&group_count_sem);
+	if (check_access_precheck(grp_count))
 		return 0;
+
+	/* has the unmodified file already been checked? */
+	switch (dazukofs_cache_lookup(dentry->d_inode)) {
+	case VERDICT_ALLOW:
+		record_hot_file(dentry->d_inode);
+
+		/* notification groups see every access, but nobody waits */
+		notify_access(dentry, mnt, grp_count);
+		return 0;
+	case VERDICT_DENY:
+		/* denied after a trusted process was allowed access */
+		return -EPERM;
+	default:
+		break;
 	}
 
 	/* at this point, the access should be handled */
 
-	if (allocate_event_and_containers(&evt, ec_array, group_count)) {
-		up_read(&group_count_sem);
-		err = -ENOMEM;
-		goto out;
+	dazukofs_cache_prepare(dentry->d_inode, &ticket);
+
+	/*
+	 * was the file checked before the module was loaded (or on another
+	 * system sharing the filesystem)?
+	 */
+	groups = atomic64_read(&verdict_groups);
+	if (dazukofs_warm_lookup(dentry, &ticket, groups) == VERDICT_ALLOW ||
+	    dazukofs_persist_lookup(dentry, &ticket, groups) ==
+	    VERDICT_ALLOW) {
+		dazukofs_cache_store(dentry->d_inode, &ticket, VERDICT_ALLOW);
+		notify_access(dentry, mnt, grp_count);
+		return 0;
 	}
 
-	evt->dentry = dget(dentry);
-	evt->mnt = mntget(mnt);
-	evt->proc_id = get_pid(task_pid(current));
+	/* was the same file just checked for this process? */
+	if (dazukofs_dedup_lookup(dentry->d_inode, &ticket, &deny)) {
+		notify_access(dentry, mnt, grp_count);
+		return deny ? -EPERM : 0;
+	}
 
-	assign_event_to_groups(evt, ec_array);
+	/* is the same file already being checked? */
+	evt = join_inflight_event(dentry->d_inode, &ticket);
+	if (evt) {
+		/* notification groups still see this access */
+		notify_access(dentry, mnt, grp_count);
+
+		/* trusted processes do not wait (the verdict of the
+		 * in-flight event is remembered anyway) */
+		if (dazukofs_check_async_process() != 0) {
+			wait_for_verdicts(evt, NULL);
+			if (evt->deny)
+				err = -EPERM;
+		}
+		put_event(evt);
+		return err;
+	}
+
+	if (dazukofs_check_async_process() == 0) {
+		/* trusted processes do not wait, the file is checked in
+		 * the background (unless memory is tight) */
+		evt = post_event(dentry, mnt, grp_count, POST_ASYNC, &ticket);
+		if (evt) {
+			event_verdict(evt, 0);
+			put_event(evt);
+		}
+		return 0;
+	}
 
-	up_read(&group_count_sem);
+	evt = check_with_groups(dentry, mnt, grp_count, &ticket);
 
-	/* wait (uninterruptible) until event completely processed */
-	wait_event(evt->queue, event_assigned(evt) == 0);
+	if (!evt->unchecked)
+		dazukofs_dedup_store(dentry->d_inode, &ticket, evt->deny);
 
 	if (evt->deny)
 		err = -EPERM;
+	else if (!evt->unchecked)
+		store_allow(dentry, evt);
 
-	release_event(evt, 0, 0);
-out:
+	put_event(evt);
 	return err;
 }
 
+/**
+ * rescan_file - check a hot file again
+ * @inode: the inode of the file
+ *
+ * Description: Files that were already checked again (or are being
+ * checked) are skipped. Only an allow verdict is remembered. The event
+ * refers to the file on the lower filesystem, so that groups holding on
+ * to it do not keep DazukoFS from being unmounted. The wait is given up
+ * if the superblock of the file is shut down.
+ */
+static void rescan_file(struct inode *inode)
+{
+	struct dazukofs_cache_ticket ticket;
+	struct dazukofs_event *evt;
+	struct dentry *dentry;
+	int grp_count;
+	int err;
+
+	/* the last group may have been removed meanwhile */
+	grp_count = ACCESS_ONCE(group_count);
+	if (grp_count == 0)
+		return;
+
+	if (dazukofs_cache_lookup(inode) != VERDICT_NONE)
+		return;
+
+	/* any name of the file will do */
+	dentry = d_find_alias(inode);
+	if (!dentry)
+		return;
+
+	dazukofs_cache_prepare(inode, &ticket);
+
+	evt = join_inflight_event(inode, &ticket);
+	if (evt) {
+		put_event(evt);
+		goto out;
+	}
+
+	evt = post_event(get_lower_dentry(dentry), get_lower_mnt(dentry),
+			 grp_count, POST_WAIT, &ticket);
+	set_inflight_event(inode, evt, NULL);
+
+	event_verdict(evt, 0);
+	err = wait_for_verdicts(evt, &rescan_abort);
+
+	set_inflight_event(inode, NULL, evt);
+
+	if (!err && !evt->deny && !evt->unchecked)
+		store_allow(dentry, evt);
+	put_event(evt);
+out:
+	dput(dentry);
+}
+
+/**
+ * rescan_hot_files - check all hot files again
+ * @work: the rescan work
+ *
+ * Description: This runs on an unbound workqueue with a single worker
+ * after a group changed its scanner epoch. The files are checked one at
+ * a time, so at most one background event is queued ahead of file
+ * accesses.
+ */
+static void rescan_hot_files(struct work_struct *work)
+{
+	struct inode *inode;
+	unsigned int i;
+
+	for (i = 0; i < rescan_max; i++) {
+		inode = take_hot_file(i);
+		if (!inode)
+			continue;
+
+		if (static_key_false(&groups_active))
+			rescan_file(inode);
+
+		finish_hot_file(inode);
+		cond_resched();
+	}
+}
+
+/**
+ * get_group - find a group and mark it as being used
+ * @group_id: id of the group to find
+ *
+ * Description: The group is looked up without taking any locks. The
+ * group will not be freed until put_group() is called. It may, however,
+ * become deprecated in the meantime.
+ *
+ * Returns the group or NULL if no (active) group has the given id.
+ */
+static struct dazukofs_group *get_group(unsigned long group_id)
+{
+	struct dazukofs_group *grp;
+
+	if (group_id >= dazukofs_max_groups)
+		return NULL;
+
+	rcu_read_lock();
+	grp = rcu_dereference(group_table[group_id]);
+	if (grp) {
+		/* the registry reference is held until a grace period
+		 * after the group was unpublished */
+		atomic_inc(&grp->use_count);
+	}
+	rcu_read_unlock();
+
+	return grp;
+}
+
+/**
+ * dazukofs_get_group_stats - get the health of a group
+ * @group_id: id of the group
+ * @stats: to be filled with the statistics of the group
+ *
+ * Returns 0 on success or -EINVAL if the group does not exist.
+ */
+int dazukofs_get_group_stats(unsigned long group_id,
+			     struct dazukofs_group_stats *stats)
+{
+	struct dazukofs_group *grp;
+
+	grp = get_group(group_id);
+	if (!grp)
+		return -EINVAL;
+
+	stats->timeouts = atomic_long_read(&grp->timeouts);
+	stats->bypassed = atomic_long_read(&grp->bypassed);
+	stats->backlog = atomic_read(&grp->todo_count);
+	stats->degraded = ACCESS_ONCE(grp->degraded);
+	stats->epoch = ACCESS_ONCE(grp->scan_epoch);
+	put_group(grp);
+
+	return 0;
+}
+
+/**
+ * dazukofs_set_group_epoch - set the scanner epoch of a group
+ * @name: the name of the group
+ * @epoch: the new epoch
+ *
+ * Description: A new epoch means that the group may now deny files it
+ * allowed before (for example, after a signature update). All cached
+ * verdicts are then ignored and the hot files are checked again in the
+ * background (if rescan_max is set). The group also gets a new set_hash,
+ * so verdicts stored beyond the inodes are ignored as well.
+ *
+ * Returns 0 on success or -EINVAL if the group does not exist.
+ */
+int dazukofs_set_group_epoch(const char *name, unsigned long epoch)
+{
+	struct dazukofs_group *grp;
+	int changed = 0;
+	int ret = -EINVAL;
+
+	mutex_lock(&group_mutex);
+
+	list_for_each_entry(grp, &group_list.list, list) {
+		if (strcmp(name, grp->name) == 0) {
+			ret = 0;
+			if (grp->scan_epoch == epoch)
+				break;
+			grp->scan_epoch = epoch;
+
+			/* notification groups do not change any verdict */
+			if (grp->notify)
+				break;
+
+			/* stored verdicts were given for the old identity */
+			atomic64_set(&verdict_groups,
+				     atomic64_read(&verdict_groups) ^
+				     grp->set_hash ^ group_set_hash(grp));
+			grp->set_hash = group_set_hash(grp);
+			changed = 1;
+			break;
+		}
+	}
+
+	mutex_unlock(&group_mutex);
+
+	if (changed) {
+		dazukofs_cache_new_epoch();
+		if (rescan_wq)
+			queue_work(rescan_wq, &rescan_work);
+	}
+
+	return ret;
+}
+
 /**
  * dazukofs_group_open_tracking - begin tracking this process
  * @group_id: id of the group we belong to
@@ -800,22 +2114,19 @@ out:
 int dazukofs_group_open_tracking(unsigned long group_id)
 {
 	struct dazukofs_group *grp;
-	struct list_head *pos;
 	int tracking = 0;
 
-	mutex_lock(&work_mutex);
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated && grp->group_id == group_id) {
-			if (grp->tracking) {
-				atomic_inc(&grp->use_count);
-				grp->track_count++;
-				tracking = 1;
-			}
-			break;
-		}
+	if (group_id >= dazukofs_max_groups)
+		return 0;
+
+	mutex_lock(&group_mutex);
+	grp = rcu_dereference_protected(group_table[group_id],
+					lockdep_is_held(&group_mutex));
+	if (grp && grp->tracking) {
+		grp->track_count++;
+		tracking = 1;
 	}
-	mutex_unlock(&work_mutex);
+	mutex_unlock(&group_mutex);
 	return tracking;
 }
 
@@ -830,44 +2141,145 @@ int dazukofs_group_open_tracking(unsigned long group_id)
 void dazukofs_group_release_tracking(unsigned long group_id)
 {
 	struct dazukofs_group *grp;
-	struct list_head *pos;
-
-	mutex_lock(&work_mutex);
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated && grp->group_id == group_id) {
-			if (grp->tracking) {
-				atomic_dec(&grp->use_count);
-				grp->track_count--;
-				if (grp->track_count == 0)
-					__remove_group(grp);
-			}
-			break;
+
+	if (group_id >= dazukofs_max_groups)
+		return;
+
+	mutex_lock(&group_mutex);
+	grp = rcu_dereference_protected(group_table[group_id],
+					lockdep_is_held(&group_mutex));
+	if (grp && grp->tracking) {
+		grp->track_count--;
+		if (grp->track_count == 0)
+			__remove_group(grp);
+	}
+	mutex_unlock(&group_mutex);
+}
+
+/**
+ * hash_working_event - publish a claimed event
+ * @grp: the group
+ * @ec: the event container (owned by the caller)
+ *
+ * Description: After the container is in the working hash, it may be
+ * answered (or released by group removal) at any time, so the caller
+ * must not touch it anymore.
+ *
+ * Returns 0 on success. If the group has been removed, -EINVAL is
+ * returned. If the container has been resolved (timed out), -ETIMEDOUT
+ * is returned. On error the caller still owns the container.
+ */
+static int hash_working_event(struct dazukofs_group *grp,
+			      struct dazukofs_event_container *ec)
+{
+	struct dazukofs_working_bucket *b;
+
+	b = working_bucket(grp, ec->event->event_id);
+
+	spin_lock(&b->lock);
+	if (grp->deprecated) {
+		spin_unlock(&b->lock);
+		return -EINVAL;
+	}
+
+	/* pairs with the barrier in resolve_container() of the opener */
+	ec->where = EC_WORKING;
+	smp_mb();
+	if (test_bit(EC_RESOLVED, &ec->flags)) {
+		ec->where = EC_NONE;
+		spin_unlock(&b->lock);
+		return -ETIMEDOUT;
+	}
+
+	hlist_add_head(&ec->hash_node, &b->head);
+	spin_unlock(&b->lock);
+
+	return 0;
+}
+
+/**
+ * unhash_working_event - take a claimed event by its id
+ * @grp: the group
+ * @event_id: the id of the event
+ *
+ * Returns the event container (now owned by the caller) or NULL if there
+ * is no such claimed event.
+ */
+static struct dazukofs_event_container *
+unhash_working_event(struct dazukofs_group *grp, unsigned long event_id)
+{
+	struct dazukofs_working_bucket *b = working_bucket(grp, event_id);
+	struct dazukofs_event_container *ec;
+	struct hlist_node *pos;
+
+	spin_lock(&b->lock);
+	hlist_for_each_entry(ec, pos, &b->head, hash_node) {
+		if (ec->event->event_id == event_id) {
+			hlist_del_init(&ec->hash_node);
+			ec->where = EC_NONE;
+			spin_unlock(&b->lock);
+			return ec;
 		}
 	}
-	mutex_unlock(&work_mutex);
+	spin_unlock(&b->lock);
+
+	return NULL;
 }
 
 /**
- * unclaim_event - return an event to the todo list
- * @grp: group to which the event is assigned
- * @ec: event container of the event to be returned
+ * dazukofs_return_events - return multiple checked file access results
+ * @group_id: id of the group the events came from
+ * @verdicts: array of event ids and responses
+ * @count: number of elements in the array
  *
- * Description: This function removes the given event container from its
- * current list, puts it on the todo list, and wakes the group.
+ * Description: This function is called by the device layer when returning
+ * results from checked file access events. The group is only looked up
+ * once for all results. For each valid event_id the event container will
+ * be freed and the event released (or the event is put back on a todo
+ * queue for REPOST).
+ *
+ * The error member of each verdict is set to 0 if the result could be
+ * applied, -EINVAL if the event_id was not valid or -ETIMEDOUT if the
+ * default answer of the group was already given.
+ *
+ * Returns 0 if the group exists.
  */
-static void unclaim_event(struct dazukofs_group *grp,
-			  struct dazukofs_event_container *ec)
+int dazukofs_return_events(unsigned long group_id,
+			   struct dazukofs_verdict *verdicts, int count)
 {
-	/* put the event on the todo list */
-	mutex_lock(&work_mutex);
-	list_del(&ec->list);
-	list_add(&ec->list, &grp->todo_list.list);
-	mutex_unlock(&work_mutex);
+	struct dazukofs_group *grp;
+	struct dazukofs_event_container *ec;
+	int i;
+
+	grp = get_group(group_id);
+	if (!grp)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		ec = unhash_working_event(grp, verdicts[i].event_id);
+		if (!ec) {
+			verdicts[i].error = -EINVAL;
+			continue;
+		}
+		verdicts[i].error = 0;
+
+		if (verdicts[i].response == REPOST) {
+			/* put the event back on the todo queue */
+			if (enqueue_event(grp, ec, 1) != 0)
+				release_container(ec);
+			continue;
+		}
+
+		if (resolve_container(ec, verdicts[i].response == DENY))
+			atomic_set(&grp->misses, 0);
+		else
+			verdicts[i].error = -ETIMEDOUT;
+		put_event(ec->event);
+	}
 
-	/* wake up someone else to handle the event */
-	wake_up(&grp->queue);
-	wake_up(&grp->poll_queue);
+	put_group(grp);
+
+	return 0;
 }
 
 /**
@@ -885,99 +2297,123 @@ static void unclaim_event(struct dazukofs_group *grp,
 int dazukofs_return_event(unsigned long group_id, unsigned long event_id,
 			  dazukofs_response_t response)
 {
-	struct dazukofs_group *grp;
-	struct dazukofs_event_container *ec = NULL;
-	struct dazukofs_event *evt = NULL;
-	struct list_head *pos;
-	int found = 0;
-	int ret = 0;
+	struct dazukofs_verdict verdict;
+	int ret;
 
-	mutex_lock(&work_mutex);
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated && grp->group_id == group_id) {
-			atomic_inc(&grp->use_count);
-			found = 1;
-			break;
-		}
-	}
+	verdict.event_id = event_id;
+	verdict.response = response;
 
-	if (!found) {
-		mutex_unlock(&work_mutex);
-		return -EINVAL;
-	}
+	ret = dazukofs_return_events(group_id, &verdict, 1);
+	if (ret)
+		return ret;
 
-	found = 0;
-	list_for_each(pos, &grp->working_list.list) {
-		ec = list_entry(pos, struct dazukofs_event_container, list);
-		evt = ec->event;
-		if (evt->event_id == event_id) {
-			found = 1;
-			if (response != REPOST) {
-				list_del(pos);
-				kmem_cache_free(
-					dazukofs_event_container_cachep, ec);
-			}
-			break;
-		}
-	}
-	mutex_unlock(&work_mutex);
+	return verdict.error;
+}
 
-	if (found) {
-		if (response == REPOST)
-			unclaim_event(grp, ec);
-		else
-			release_event(evt, 1, response == DENY);
-	} else {
-		ret = -EINVAL;
+/**
+ * dequeue_from - take the first event from a todo queue
+ * @grp: the group
+ * @q: the todo queue
+ *
+ * Returns the event container (now owned by the caller) or NULL.
+ */
+static struct dazukofs_event_container *
+dequeue_from(struct dazukofs_group *grp, struct dazukofs_todo_queue *q)
+{
+	struct dazukofs_event_container *ec = NULL;
+
+	/* do not bother locking empty queues */
+	if (list_empty(&q->list))
+		return NULL;
+
+	spin_lock(&q->lock);
+	if (!list_empty(&q->list)) {
+		ec = list_first_entry(&q->list,
+				      struct dazukofs_event_container, list);
+		list_del_init(&ec->list);
+		ec->where = EC_NONE;
+		atomic_dec(&grp->todo_count);
 	}
-	atomic_dec(&grp->use_count);
+	spin_unlock(&q->lock);
 
-	return ret;
+	return ec;
 }
 
 /**
- * claim_event - grab an event from the todo list
+ * claim_event - grab an event from the todo queues
  * @grp: the group
+ * @node: the preferred NUMA node (or NUMA_NO_NODE)
  *
- * Description: Take the first event from the todo list and move it to the
- * working list. The event is then returned to its called for processing.
+ * Description: Take the first event from the todo queue of the current
+ * cpu. If that queue is empty, events queued on the other cpus of the
+ * preferred node are taken. Only when the node has no more events, an
+ * event is stolen from a remote node. If no node is preferred, the node
+ * of the current cpu is used. The caller must either publish the event
+ * with hash_working_event() or put it back with enqueue_event().
  *
  * Returns the claimed event.
  */
-static struct dazukofs_event_container *claim_event(struct dazukofs_group *grp)
+static struct dazukofs_event_container *claim_event(struct dazukofs_group *grp,
+						    int node)
 {
-	struct dazukofs_event_container *ec = NULL;
+	struct dazukofs_event_container *ec;
+	const struct cpumask *node_cpus;
+	int this_cpu = raw_smp_processor_id();
+	int cpu;
 
-	/* move first todo-item to working list */
-	mutex_lock(&work_mutex);
-	if (!list_empty(&grp->todo_list.list)) {
-		ec = list_first_entry(&grp->todo_list.list,
-				      struct dazukofs_event_container, list);
-		list_del(&ec->list);
-		list_add(&ec->list, &grp->working_list.list);
+	if (atomic_read(&grp->todo_count) == 0)
+		return NULL;
+
+	if (node == NUMA_NO_NODE)
+		node = cpu_to_node(this_cpu);
+	node_cpus = cpumask_of_node(node);
+
+	if (cpumask_test_cpu(this_cpu, node_cpus)) {
+		ec = dequeue_from(grp, per_cpu_ptr(grp->todo, this_cpu));
+		if (ec)
+			return ec;
 	}
-	mutex_unlock(&work_mutex);
 
-	return ec;
+	for_each_cpu(cpu, node_cpus) {
+		if (cpu == this_cpu)
+			continue;
+		ec = dequeue_from(grp, per_cpu_ptr(grp->todo, cpu));
+		if (ec)
+			return ec;
+	}
+
+	/* local work has run dry, steal from remote nodes */
+	for_each_possible_cpu(cpu) {
+		if (cpumask_test_cpu(cpu, node_cpus))
+			continue;
+		ec = dequeue_from(grp, per_cpu_ptr(grp->todo, cpu));
+		if (ec)
+			return ec;
+	}
+
+	return NULL;
 }
 
 /**
  * mask_proc - mask the current process
- * @proc: process structure to use for the list
+ * @proc: process structure to use for the hash
  *
  * Description: Assign the current process to the provided proc structure
- * and add the structure to the list. The list is used to prevent
+ * and add the structure to the hash. The hash is used to prevent
  * generating recursive file access events. The process is removed from
- * the list with the check_recursion() function.
+ * the hash with the check_recursion() function.
  */
 static void mask_proc(struct dazukofs_proc *proc)
 {
-	proc->proc_id = get_pid(task_pid(current));
-	mutex_lock(&proc_mutex);
-	list_add(&proc->list, &proc_list.list);
+	struct dazukofs_proc_bucket *bucket = proc_hash_bucket(current);
+
+	proc->task = current;
+
+	spin_lock(&bucket->lock);
+	hlist_add_head(&proc->hash_node, &bucket->head);
 	proc->within_list = 1;
-	mutex_unlock(&proc_mutex);
+	atomic_inc(&proc_count);
+	spin_unlock(&bucket->lock);
 }
 
 /**
@@ -988,6 +2424,9 @@ static void mask_proc(struct dazukofs_proc *proc)
  * the provided event container. The calling process will be temporarily
  * masked so that the file open does not generate a file access event.
  *
+ * The file descriptor is only reserved. The caller must install it with
+ * fd_install() or release it with put_unused_fd().
+ *
  * Returns 0 on success.
  */
 static int open_file(struct dazukofs_event_container *ec)
@@ -1021,7 +2460,7 @@ static int open_file(struct dazukofs_event_container *ec)
 #endif
 
 	/* If dentry_open() was successful, it should have removed us from
-	 * proc_list. If it didn't do this, we do it now ourselves. */
+	 * the proc hash. If it didn't do this, we do it now ourselves. */
 	if (proc.within_list)
 		check_recursion();
 
@@ -1030,8 +2469,6 @@ static int open_file(struct dazukofs_event_container *ec)
 		goto error_out2;
 	}
 
-	fd_install(ec->fd, ec->file);
-
 	return 0;
 
 error_out2:
@@ -1045,20 +2482,13 @@ error_out1:
  * @grp: the group
  *
  * Description: This function simply checks if there are any events posted
- * in the group's todo list.
+ * in the group's todo queues.
  *
- * Returns 0 if there are no events in the todo list.
+ * Returns 0 if there are no events in the todo queues.
  */
 static int is_event_available(struct dazukofs_group *grp)
 {
-	int ret = 0;
-
-	mutex_lock(&work_mutex);
-	if (!list_empty(&grp->todo_list.list))
-		ret = 1;
-	mutex_unlock(&work_mutex);
-
-	return ret;
+	return atomic_read(&grp->todo_count) > 0;
 }
 
 /**
@@ -1077,101 +2507,156 @@ static int is_event_available(struct dazukofs_group *grp)
 unsigned int dazukofs_poll(unsigned long group_id, struct file *dev_file,
 			   poll_table *wait)
 {
-	struct dazukofs_group *grp = NULL;
-	struct list_head *pos;
+	struct dazukofs_group *grp;
 	unsigned int mask = 0;
-	int found = 0;
 
-	mutex_lock(&work_mutex);
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated && grp->group_id == group_id) {
-			atomic_inc(&grp->use_count);
-			found = 1;
-			break;
-		}
-	}
-	mutex_unlock(&work_mutex);
-
-	if (!found)
+	grp = get_group(group_id);
+	if (!grp)
 		return POLLERR;
 
+	check_group_recovery(grp);
+
 	poll_wait(dev_file, &grp->poll_queue, wait);
 	if (is_event_available(grp))
 		mask = POLLIN | POLLRDNORM;
 
-	atomic_dec(&grp->use_count);
+	put_group(grp);
 
 	return mask;
 }
 
+/**
+ * wait_for_event - wait until an event is available
+ * @grp: the group
+ *
+ * Description: The wait is exclusive, so that a new event only wakes one
+ * of the registered processes. If a woken process is interrupted by a
+ * signal instead, the wakeup is passed on to the next waiter.
+ *
+ * Returns 0 if an event is available or the group was removed.
+ */
+static int wait_for_event(struct dazukofs_group *grp)
+{
+	DEFINE_WAIT(wait);
+	int ret = 0;
+
+	for (;;) {
+		prepare_to_wait_exclusive(&grp->queue, &wait,
+					  TASK_INTERRUPTIBLE);
+		if (is_event_available(grp) || grp->deprecated)
+			break;
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	}
+
+	if (ret)
+		abort_exclusive_wait(&grp->queue, &wait, TASK_INTERRUPTIBLE,
+				     NULL);
+	else
+		finish_wait(&grp->queue, &wait);
+
+	return ret;
+}
+
 /**
  * dazukofs_get_event - get an event to process
  * @group_id: id of the group we belong to
+ * @nonblock: flag set if the function should not wait for an event
+ * @node: the NUMA node to prefer events from (or NUMA_NO_NODE)
  * @event_id: to be filled in with the new event id
  * @fd: to be filled in with the opened file descriptor
  * @pid: to be filled in with the pid of the process generating the event
+ * @flags: to be filled in with DAZUKOFS_EVENT_* flags
  *
  * Description: This function is called by the device layer to get a new
  * file access event to process. It waits until an event has been
  * posted in the todo list (and is successfully claimed by this process).
  *
+ * If the nonblock flag is set and no event can be claimed immediately,
+ * -EAGAIN is returned.
+ *
  * Returns 0 on success.
  */
-int dazukofs_get_event(unsigned long group_id, unsigned long *event_id,
-		       int *fd, pid_t *pid)
+int dazukofs_get_event(unsigned long group_id, int nonblock, int node,
+		       unsigned long *event_id, int *fd, pid_t *pid,
+		       int *flags)
 {
-	struct dazukofs_group *grp = NULL;
+	struct dazukofs_group *grp;
 	struct dazukofs_event_container *ec;
-	struct list_head *pos;
-	int found = 0;
+	struct file *file;
 	int ret = 0;
 
-	mutex_lock(&work_mutex);
-	list_for_each(pos, &group_list.list) {
-		grp = list_entry(pos, struct dazukofs_group, list);
-		if (!grp->deprecated && grp->group_id == group_id) {
-			atomic_inc(&grp->use_count);
-			found = 1;
-			break;
-		}
-	}
-	mutex_unlock(&work_mutex);
-
-	if (!found)
+	grp = get_group(group_id);
+	if (!grp)
 		return -EINVAL;
 
 	while (1) {
-		ret = wait_event_freezable(grp->queue,
-					   is_event_available(grp) ||
-					   grp->deprecated);
-		if (ret != 0)
-			break;
+		check_group_recovery(grp);
+
+		if (!nonblock) {
+			ret = wait_for_event(grp);
+			if (ret != 0)
+				break;
+		}
 
 		if (grp->deprecated) {
 			ret = -EINVAL;
 			break;
 		}
 
-		ec = claim_event(grp);
+		ec = claim_event(grp, node);
+		if (!ec && nonblock) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		if (ec && test_bit(EC_RESOLVED, &ec->flags)) {
+			/* the opener is no longer waiting for this group */
+			put_event(ec->event);
+			continue;
+		}
+
 		if (ec) {
 			ret = open_file(ec);
 			if (ret == 0) {
 				*event_id = ec->event->event_id;
 				*fd = ec->fd;
+				file = ec->file;
 
 				/* set to 0 if not within namespace */
 				*pid = pid_vnr(ec->event->proc_id);
+
+				*flags = 0;
+				if (ec->event->async)
+					*flags |= DAZUKOFS_EVENT_ASYNC;
+
+				ret = hash_working_event(grp, ec);
+				if (ret == 0) {
+					fd_install(*fd, file);
+					break;
+				}
+
+				/* the group was removed or the event timed
+				 * out meanwhile */
+				fput(file);
+				put_unused_fd(*fd);
+				release_container(ec);
+				if (ret == -ETIMEDOUT)
+					continue;
 				break;
 			} else {
-				unclaim_event(grp, ec);
+				if (enqueue_event(grp, ec, 1) != 0)
+					release_container(ec);
 				/* The registered process was not allowed
 				 * to open the file! */
 				break;
 			}
 		}
 	}
-	atomic_dec(&grp->use_count);
+	put_group(grp);
 
 	return ret;
 }
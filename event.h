@@ -23,22 +23,46 @@
 
 #include <linux/poll.h>
 
+/* flags for dazukofs_add_group() */
+#define DAZUKOFS_GROUP_TRACK	1
+#define DAZUKOFS_GROUP_NOTIFY	2
+
+/* flags of an event returned by dazukofs_get_event() */
+#define DAZUKOFS_EVENT_ASYNC	1
+
 typedef enum {
 	ALLOW,
 	DENY,
 	REPOST,
 } dazukofs_response_t;
 
+struct dazukofs_group_stats {
+	unsigned long timeouts;
+	unsigned long bypassed;
+	unsigned long backlog;
+	int degraded;
+	unsigned long epoch;
+};
+
+struct dazukofs_verdict {
+	unsigned long event_id;
+	dazukofs_response_t response;
+	int error;
+};
+
 extern int dazukofs_init_events(void);
 extern void dazukofs_destroy_events(void);
 
 extern unsigned int dazukofs_poll(unsigned long group_id,
 				  struct file *dev_file, poll_table *wait);
-extern int dazukofs_get_event(unsigned long group_id,
-			      unsigned long *event_id, int *fd, pid_t *pid);
+extern int dazukofs_get_event(unsigned long group_id, int nonblock,
+			      int node, unsigned long *event_id, int *fd,
+			      pid_t *pid, int *flags);
 extern int dazukofs_return_event(unsigned long group_id,
 				 unsigned long event_id,
 				 dazukofs_response_t response);
+extern int dazukofs_return_events(unsigned long group_id,
+				  struct dazukofs_verdict *verdicts, int count);
 
 extern int dazukofs_check_access(struct dentry *dentry, struct vfsmount *mnt);
 
@@ -46,7 +70,13 @@ extern int dazukofs_group_open_tracking(unsigned long group_id);
 extern void dazukofs_group_release_tracking(unsigned long group_id);
 
 extern int dazukofs_get_groups(char **buf);
-extern int dazukofs_add_group(const char *name, int track);
+extern int dazukofs_add_group(const char *name, int flags);
 extern int dazukofs_remove_group(const char *name, int unused);
+extern int dazukofs_set_group_timeout(const char *name, unsigned int msecs,
+				      int deny);
+extern int dazukofs_get_group_stats(unsigned long group_id,
+				    struct dazukofs_group_stats *stats);
+extern int dazukofs_set_group_epoch(const char *name, unsigned long epoch);
+extern void dazukofs_drop_hot_files(struct super_block *sb);
 
 #endif /* __EVENT_H */
@@ -32,6 +32,7 @@
 
 #include "dazukofs_fs.h"
 #include "event.h"
+#include "cache.h"
 
 /**
  * Description: Called when the VFS needs to move the file position index.
@@ -131,6 +132,14 @@ static ssize_t dazukofs_write(struct file *file, const char *buf,
 		return -EINVAL;
 
 	mutex_lock(&inode->i_mutex);
+
+	/*
+	 * The contents change while the lower write is running, so no
+	 * cached verdict may be used from now on. The cache is invalidated
+	 * again afterwards for verdicts given during the write.
+	 */
+	dazukofs_cache_invalidate(inode);
+
 	ret = vfs_write(lower_file, buf, count, &pos_copy);
 
 	lower_file->f_pos = pos_copy;
@@ -147,6 +156,10 @@ static ssize_t dazukofs_write(struct file *file, const char *buf,
 		 */
 		mark_pages_outdated(file, ret, pos_copy - ret);
 		fsstack_copy_attr_atime(inode, lower_inode);
+
+		/* the file contents have changed */
+		if (ret > 0)
+			dazukofs_cache_invalidate(inode);
 	}
 
 	*ppos = pos_copy;
@@ -341,6 +354,10 @@ static int dazukofs_mmap(struct file *file, struct vm_area_struct *vm)
 	if (!lower_file->f_op || !lower_file->f_op->mmap)
 		return -ENODEV;
 
+	/* the file contents may be changed through a shared mapping */
+	if ((vm->vm_flags & VM_SHARED) && (vm->vm_flags & VM_MAYWRITE))
+		dazukofs_cache_invalidate(file->f_dentry->d_inode);
+
 	return generic_file_mmap(file, vm);
 }
 
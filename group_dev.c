@@ -23,60 +23,588 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/syscalls.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
 
 #include "dazukofs_fs.h"
 #include "event.h"
 #include "dev.h"
 
-static int dazukofs_group_open(int group_id, struct inode *inode,
-			       struct file *file)
+#define DAZUKOFS_MIN_READ_BUFFER 43
+#define DAZUKOFS_EVENT_BUFFER (DAZUKOFS_MIN_READ_BUFFER + sizeof("async=1\n"))
+#define DAZUKOFS_BAD_ID_BUFFER 26
+#define DAZUKOFS_MAX_BAD_IDS 64
+#define DAZUKOFS_MAX_BATCH 256
+#define DAZUKOFS_MAX_RING_ENTRIES 4096
+#define DAZUKOFS_RING_CHUNK 64
+
+/*
+ * Layout of the memory shared with the application in ring mode. The
+ * header is followed by the submission ring (events, filled by the
+ * kernel) and the completion ring (verdicts, filled by the application).
+ * Head and tail are free running counters. The slot of a counter value
+ * is (value & (entries - 1)).
+ */
+struct dazukofs_ring_header {
+	__u32 entries;
+	__u32 sq_offset;
+	__u32 cq_offset;
+	__u32 reserved;
+
+	/* submission ring: the kernel moves the tail, the application
+	 * moves the head */
+	__u32 sq_head;
+	__u32 sq_tail;
+
+	/* completion ring: the application moves the tail, the kernel
+	 * moves the head */
+	__u32 cq_head;
+	__u32 cq_tail;
+};
+
+/* a fd of -1 reports a verdict for event_id that could not be applied */
+struct dazukofs_ring_event {
+	__u64 event_id;
+	__s32 fd;
+	__s32 pid;
+	__u32 flags;
+	__u32 reserved;
+};
+
+struct dazukofs_ring_verdict {
+	__u64 event_id;
+	__u32 response;
+	__u32 reserved;
+};
+
+#define DAZUKOFS_RING_SQ_OFFSET 64
+
+struct dazukofs_group_file {
+	int group_id;
+	int tracking;
+
+	/* NUMA node to prefer events from (NUMA_NO_NODE = current node) */
+	int node;
+
+	/* maximum number of events returned per read (0 = classic mode) */
+	int batch;
+
+	/* protects: bad_ids, bad_count */
+	struct mutex lock;
+
+	/* event ids of batch verdicts that could not be applied */
+	unsigned long bad_ids[DAZUKOFS_MAX_BAD_IDS];
+	int bad_count;
+
+	/* protects: ring, ring_size, ring_entries, ring_verdicts */
+	struct mutex ring_lock;
+
+	/*
+	 * shared memory in ring mode (NULL = not in ring mode). The
+	 * application can modify the header, so the kernel keeps its own
+	 * copy of the ring geometry.
+	 */
+	struct dazukofs_ring_header *ring;
+	unsigned long ring_size;
+	u32 ring_entries;
+	struct dazukofs_verdict *ring_verdicts;
+};
+
+struct dazukofs_claimed_event {
+	unsigned long event_id;
+	int fd;
+};
+
+/* minor number of the first group device */
+static int group_minor_start;
+
+static int dazukofs_group_open(struct inode *inode, struct file *file)
 {
-	if (dazukofs_group_open_tracking(group_id))
-		file->private_data = file;
-	else
-		file->private_data = NULL;
+	struct dazukofs_group_file *gf;
+	int group_id = iminor(inode) - group_minor_start;
+
+	gf = kzalloc(sizeof(struct dazukofs_group_file), GFP_KERNEL);
+	if (!gf)
+		return -ENOMEM;
+
+	mutex_init(&gf->lock);
+	mutex_init(&gf->ring_lock);
+	gf->group_id = group_id;
+	gf->node = numa_node_id();
+	gf->tracking = dazukofs_group_open_tracking(group_id);
+	file->private_data = gf;
 	return 0;
 }
 
-static int dazukofs_group_release(int group_id, struct inode *inode,
-				  struct file *file)
+static int dazukofs_group_release(struct inode *inode, struct file *file)
 {
-	if (file->private_data)
-		dazukofs_group_release_tracking(group_id);
+	struct dazukofs_group_file *gf = file->private_data;
+
+	if (gf->tracking)
+		dazukofs_group_release_tracking(gf->group_id);
+	if (gf->ring) {
+		vfree(gf->ring);
+		kfree(gf->ring_verdicts);
+	}
+	kfree(gf);
 	return 0;
 }
 
-static ssize_t dazukofs_group_read(int group_id, struct file *file,
-				   char __user *buffer, size_t length,
-				   loff_t *pos)
+/**
+ * format_event - write the text form of an event
+ * @buf: the buffer
+ * @size: the size of the buffer
+ * @event_id: the event id
+ * @fd: the file descriptor of the accessed file
+ * @pid: the pid of the accessing process
+ * @flags: DAZUKOFS_EVENT_* flags of the event
+ *
+ * Returns the length of the text (as snprintf()).
+ */
+static int format_event(char *buf, size_t size, unsigned long event_id,
+			int fd, pid_t pid, int flags)
 {
-#define DAZUKOFS_MIN_READ_BUFFER 43
-	char tmp[DAZUKOFS_MIN_READ_BUFFER];
+	const char *async = "";
+
+	if (flags & DAZUKOFS_EVENT_ASYNC)
+		async = "async=1\n";
+
+	return snprintf(buf, size, "id=%lu\nfd=%d\npid=%d\n%s", event_id,
+			fd, pid, async);
+}
+
+/**
+ * get_event_error - convert errors to acceptable read(2) errno values
+ * @err: error returned by dazukofs_get_event()
+ */
+static int get_event_error(int err)
+{
+	if (err == -ERESTARTSYS)
+		return -EINTR;
+	else if (err == -ENFILE)
+		return -EIO;
+	return err;
+}
+
+/**
+ * add_bad_id - remember a verdict that could not be applied
+ * @gf: the group file the verdict was written to
+ * @event_id: the event id of the verdict
+ *
+ * Description: The event id is reported with the next batch read. If too
+ * many ids are pending, the id is dropped.
+ */
+static void add_bad_id(struct dazukofs_group_file *gf, unsigned long event_id)
+{
+	mutex_lock(&gf->lock);
+	if (gf->bad_count < DAZUKOFS_MAX_BAD_IDS)
+		gf->bad_ids[gf->bad_count++] = event_id;
+	mutex_unlock(&gf->lock);
+}
+
+/**
+ * format_bad_ids - print pending bad ids into a buffer
+ * @gf: the group file
+ * @buf: the buffer to print into
+ * @buflen: the size of the buffer
+ *
+ * Description: As many pending bad ids as fit are printed and removed
+ * from the group file.
+ *
+ * Returns the number of bytes used in the buffer.
+ */
+static size_t format_bad_ids(struct dazukofs_group_file *gf, char *buf,
+			     size_t buflen)
+{
+	size_t buf_used = 0;
+	int i;
+
+	mutex_lock(&gf->lock);
+	for (i = 0; i < gf->bad_count; i++) {
+		if (buflen - buf_used < DAZUKOFS_BAD_ID_BUFFER)
+			break;
+		buf_used += snprintf(buf + buf_used, DAZUKOFS_BAD_ID_BUFFER,
+				     "bad=%lu\n", gf->bad_ids[i]);
+	}
+	gf->bad_count -= i;
+	memmove(gf->bad_ids, gf->bad_ids + i,
+		gf->bad_count * sizeof(unsigned long));
+	mutex_unlock(&gf->lock);
+
+	return buf_used;
+}
+
+static ssize_t dazukofs_group_read_batch(int group_id,
+					 struct dazukofs_group_file *gf,
+					 char __user *buffer, size_t length)
+{
+	struct dazukofs_claimed_event *claimed;
+	char *buf;
+	size_t buflen;
+	size_t buf_used;
+	ssize_t used;
+	int count = 0;
+	int max_count;
+	int batch;
+	pid_t pid;
+	int flags;
+	int err = 0;
+	int i;
+
+	/* "batch=" may be written concurrently, the size is read once */
+	batch = ACCESS_ONCE(gf->batch);
+	if (batch == 0)
+		return -EINVAL;
+
+	buflen = DAZUKOFS_MAX_BAD_IDS * DAZUKOFS_BAD_ID_BUFFER +
+		 batch * DAZUKOFS_EVENT_BUFFER;
+	if (buflen > length)
+		buflen = length;
+
+	buf = kmalloc(buflen, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	claimed = kmalloc(batch * sizeof(struct dazukofs_claimed_event),
+			  GFP_KERNEL);
+	if (!claimed) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	/* verdicts that could not be applied are reported first */
+	buf_used = format_bad_ids(gf, buf, buflen);
+
+	/* only claim as many events as are guaranteed to fit */
+	max_count = (buflen - buf_used) / DAZUKOFS_EVENT_BUFFER;
+	if (max_count > batch)
+		max_count = batch;
+
+	/* wait for the first event, then take whatever else is available */
+	while (count < max_count) {
+		err = dazukofs_get_event(group_id, count > 0 || buf_used > 0,
+					 gf->node, &claimed[count].event_id,
+					 &claimed[count].fd, &pid, &flags);
+		if (err)
+			break;
+
+		used = format_event(buf + buf_used, DAZUKOFS_EVENT_BUFFER,
+				    claimed[count].event_id,
+				    claimed[count].fd, pid, flags);
+		if (used >= DAZUKOFS_EVENT_BUFFER) {
+			sys_close(claimed[count].fd);
+			dazukofs_return_event(group_id,
+					      claimed[count].event_id, REPOST);
+			err = -EINVAL;
+			break;
+		}
+		buf_used += used;
+		count++;
+	}
+
+	if (buf_used == 0) {
+		err = get_event_error(err);
+		goto out;
+	}
+
+	if (copy_to_user(buffer, buf, buf_used)) {
+		for (i = 0; i < count; i++) {
+			sys_close(claimed[i].fd);
+			dazukofs_return_event(group_id, claimed[i].event_id,
+					      REPOST);
+		}
+		err = -EFAULT;
+		goto out;
+	}
+
+	err = buf_used;
+out:
+	kfree(claimed);
+	kfree(buf);
+	return err;
+}
+
+/**
+ * ring_complete - apply the verdicts of the completion ring
+ * @group_id: id of the group the file belongs to
+ * @gf: the group file (ring_lock held)
+ *
+ * Description: Verdicts that cannot be applied are remembered as bad ids
+ * and reported through the submission ring.
+ *
+ * Returns the number of consumed verdicts or a negative error.
+ */
+static int ring_complete(int group_id, struct dazukofs_group_file *gf)
+{
+	struct dazukofs_ring_header *hdr = gf->ring;
+	struct dazukofs_ring_verdict *cq;
+	struct dazukofs_ring_verdict *slot;
+	u32 mask = gf->ring_entries - 1;
+	u32 head = ACCESS_ONCE(hdr->cq_head);
+	u32 tail = ACCESS_ONCE(hdr->cq_tail);
+	int consumed = 0;
+	int count;
+	int err;
+	int i;
+
+	if (tail - head > gf->ring_entries)
+		return -EINVAL;
+
+	/* read the tail before the slots */
+	smp_rmb();
+
+	cq = (void *)hdr + DAZUKOFS_RING_SQ_OFFSET +
+	     gf->ring_entries * sizeof(struct dazukofs_ring_event);
+
+	while (head != tail) {
+		count = 0;
+		while (head != tail && count < DAZUKOFS_RING_CHUNK) {
+			slot = &cq[head & mask];
+			gf->ring_verdicts[count].event_id =
+				(unsigned long)ACCESS_ONCE(slot->event_id);
+			if (ACCESS_ONCE(slot->response) != 0)
+				gf->ring_verdicts[count].response = DENY;
+			else
+				gf->ring_verdicts[count].response = ALLOW;
+			head++;
+			count++;
+		}
+
+		err = dazukofs_return_events(group_id, gf->ring_verdicts,
+					     count);
+		if (err)
+			return err;
+
+		for (i = 0; i < count; i++) {
+			if (gf->ring_verdicts[i].error)
+				add_bad_id(gf, gf->ring_verdicts[i].event_id);
+		}
+		consumed += count;
+	}
+
+	/* finish reading the slots before giving them back */
+	smp_mb();
+	hdr->cq_head = head;
+
+	return consumed;
+}
+
+/**
+ * ring_submit - fill the submission ring with bad ids and new events
+ * @group_id: id of the group the file belongs to
+ * @gf: the group file (ring_lock held)
+ * @nonblock: if set, do not wait for new events
+ *
+ * Returns the number of submitted entries or a negative error.
+ */
+static int ring_submit(int group_id, struct dazukofs_group_file *gf,
+		       int nonblock)
+{
+	struct dazukofs_ring_header *hdr = gf->ring;
+	struct dazukofs_ring_event *sq;
+	struct dazukofs_ring_event *slot;
+	u32 mask = gf->ring_entries - 1;
+	u32 tail = ACCESS_ONCE(hdr->sq_tail);
+	u32 head = ACCESS_ONCE(hdr->sq_head);
+	int space;
+	unsigned long event_id;
+	int submitted = 0;
+	int fd;
+	pid_t pid;
+	int flags;
+	int err = 0;
+	int i;
+
+	if (tail - head > gf->ring_entries)
+		return -EINVAL;
+	space = gf->ring_entries - (tail - head);
+
+	/* do not overwrite slots the application is still reading */
+	smp_mb();
+
+	sq = (void *)hdr + DAZUKOFS_RING_SQ_OFFSET;
+
+	/* verdicts that could not be applied are reported first */
+	mutex_lock(&gf->lock);
+	for (i = 0; i < gf->bad_count && submitted < space; i++) {
+		slot = &sq[tail & mask];
+		slot->event_id = gf->bad_ids[i];
+		slot->fd = -1;
+		slot->pid = 0;
+		slot->flags = 0;
+		tail++;
+		submitted++;
+	}
+	gf->bad_count -= i;
+	memmove(gf->bad_ids, gf->bad_ids + i,
+		gf->bad_count * sizeof(unsigned long));
+	mutex_unlock(&gf->lock);
+
+	/* wait for the first event, then take whatever else is available */
+	while (submitted < space) {
+		err = dazukofs_get_event(group_id, nonblock || submitted > 0,
+					 gf->node, &event_id, &fd, &pid, &flags);
+		if (err)
+			break;
+
+		slot = &sq[tail & mask];
+		slot->event_id = event_id;
+		slot->fd = fd;
+		slot->pid = pid;
+		slot->flags = flags;
+		tail++;
+		submitted++;
+	}
+
+	/* publish the slots before the tail */
+	smp_wmb();
+	hdr->sq_tail = tail;
+
+	if (submitted == 0 && !(nonblock && err == -EAGAIN))
+		return get_event_error(err);
+
+	return submitted;
+}
+
+/**
+ * dazukofs_group_read_ring - ring mode doorbell
+ * @group_id: id of the group the file belongs to
+ * @gf: the group file
+ *
+ * Description: All verdicts in the completion ring are applied and the
+ * submission ring is filled with new events. If no verdicts were applied
+ * and the submission ring has room, this blocks until at least one event
+ * is available. The file descriptors for the events must be created in
+ * the context of the application, which is why the doorbell is needed.
+ *
+ * Returns the number of new entries in the submission ring.
+ */
+static ssize_t dazukofs_group_read_ring(int group_id,
+					struct dazukofs_group_file *gf)
+{
+	int completed;
+	int err;
+
+	mutex_lock(&gf->ring_lock);
+
+	completed = ring_complete(group_id, gf);
+	if (completed < 0) {
+		err = completed;
+		goto out;
+	}
+
+	err = ring_submit(group_id, gf, completed > 0);
+out:
+	mutex_unlock(&gf->ring_lock);
+	return err;
+}
+
+/**
+ * set_ring - process a "ring=" command
+ * @gf: the group file
+ * @arg: the command argument
+ *
+ * Description: Allocate the shared memory for ring mode. The number of
+ * entries must be a power of 2. Ring mode cannot be changed once it has
+ * been enabled.
+ *
+ * Returns 0 on success.
+ */
+static int set_ring(struct dazukofs_group_file *gf, const char *arg)
+{
+	struct dazukofs_ring_header *hdr;
+	unsigned long entries = simple_strtoul(arg, NULL, 10);
+	unsigned long size;
+	int err = 0;
+
+	if (entries == 0 || entries > DAZUKOFS_MAX_RING_ENTRIES ||
+	    !is_power_of_2(entries))
+		return -EINVAL;
+
+	size = PAGE_ALIGN(DAZUKOFS_RING_SQ_OFFSET +
+			  entries * sizeof(struct dazukofs_ring_event) +
+			  entries * sizeof(struct dazukofs_ring_verdict));
+
+	mutex_lock(&gf->ring_lock);
+
+	if (gf->ring) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	gf->ring_verdicts = kmalloc(DAZUKOFS_RING_CHUNK *
+				    sizeof(struct dazukofs_verdict),
+				    GFP_KERNEL);
+	if (!gf->ring_verdicts) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	hdr = vmalloc_user(size);
+	if (!hdr) {
+		kfree(gf->ring_verdicts);
+		gf->ring_verdicts = NULL;
+		err = -ENOMEM;
+		goto out;
+	}
+
+	hdr->entries = entries;
+	hdr->sq_offset = DAZUKOFS_RING_SQ_OFFSET;
+	hdr->cq_offset = DAZUKOFS_RING_SQ_OFFSET +
+			 entries * sizeof(struct dazukofs_ring_event);
+
+	gf->ring_size = size;
+	gf->ring_entries = entries;
+	gf->ring = hdr;
+out:
+	mutex_unlock(&gf->ring_lock);
+	return err;
+}
+
+static ssize_t dazukofs_group_read(struct file *file, char __user *buffer,
+				   size_t length, loff_t *pos)
+{
+	struct dazukofs_group_file *gf = file->private_data;
+	int group_id = gf->group_id;
+	char tmp[DAZUKOFS_EVENT_BUFFER];
 	ssize_t tmp_used;
 	pid_t pid;
+	int flags;
 	int fd;
 	int err;
 	unsigned long event_id;
 
-	if (*pos > 0)
-		return 0;
+	/* in ring mode a read only serves as doorbell */
+	if (gf->ring)
+		return dazukofs_group_read_ring(group_id, gf);
 
 	if (length < DAZUKOFS_MIN_READ_BUFFER)
 		return -EINVAL;
 
-	err = dazukofs_get_event(group_id, &event_id, &fd, &pid);
-	if (err) {
-		/* convert some errors to acceptable read(2) errno values */
-		if (err == -ERESTARTSYS)
-			return -EINTR;
-		else if (err == -ENFILE)
-			return -EIO;
-		return err;
+	/* batch mode does not require the file position to be reset */
+	if (gf->batch) {
+		/* at least one event must fit, a read of 0 would mean EOF */
+		if (length < DAZUKOFS_EVENT_BUFFER)
+			return -EINVAL;
+		return dazukofs_group_read_batch(group_id, gf, buffer, length);
 	}
 
-	tmp_used = snprintf(tmp, sizeof(tmp)-1, "id=%lu\nfd=%d\npid=%d\n",
-			    event_id, fd, pid);
-	if (tmp_used >= sizeof(tmp)) {
+	if (*pos > 0)
+		return 0;
+
+	err = dazukofs_get_event(group_id, 0, gf->node, &event_id, &fd, &pid,
+				 &flags);
+	if (err)
+		return get_event_error(err);
+
+	tmp_used = format_event(tmp, sizeof(tmp)-1, event_id, fd, pid, flags);
+	if (tmp_used >= sizeof(tmp) || tmp_used > length) {
 		sys_close(fd);
 		dazukofs_return_event(group_id, event_id, REPOST);
 		return -EINVAL;
@@ -93,11 +621,165 @@ static ssize_t dazukofs_group_read(int group_id, struct file *file,
 	return tmp_used;
 }
 
-static ssize_t dazukofs_group_write(int group_id, struct file *file,
+/**
+ * set_batch - process a "batch=" command
+ * @gf: the group file
+ * @arg: the command argument
+ *
+ * Returns 0 on success.
+ */
+static int set_batch(struct dazukofs_group_file *gf, const char *arg)
+{
+	unsigned long batch = simple_strtoul(arg, NULL, 10);
+
+	if (batch > DAZUKOFS_MAX_BATCH)
+		return -EINVAL;
+	ACCESS_ONCE(gf->batch) = batch;
+	return 0;
+}
+
+/**
+ * set_node - process a "node=" command
+ * @gf: the group file
+ * @arg: the command argument
+ *
+ * Description: Events queued on cpus of the given node are preferred. A
+ * value of -1 means the node of the cpu the process is running on.
+ *
+ * Returns 0 on success.
+ */
+static int set_node(struct dazukofs_group_file *gf, const char *arg)
+{
+	long node = simple_strtol(arg, NULL, 10);
+
+	if (node == -1) {
+		gf->node = NUMA_NO_NODE;
+		return 0;
+	}
+
+	if (node < 0 || node >= MAX_NUMNODES || !node_online(node))
+		return -EINVAL;
+
+	gf->node = node;
+	return 0;
+}
+
+static ssize_t dazukofs_group_write_batch(int group_id,
+					  struct dazukofs_group_file *gf,
+					  const char __user *buffer,
+					  size_t length)
+{
+	struct dazukofs_verdict *verdicts;
+	unsigned long event_id;
+	char *buf;
+	char *cur;
+	char *line;
+	char *p;
+	char *p2;
+	int max_count = 1;
+	int count = 0;
+	int truncated = 0;
+	int ret;
+	int i;
+
+	if (length >= PAGE_SIZE) {
+		length = PAGE_SIZE - 1;
+		truncated = 1;
+	}
+
+	buf = kmalloc(length + 1, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	if (copy_from_user(buf, buffer, length)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	buf[length] = 0;
+
+	/* only consume complete lines, the rest must be written again */
+	if (truncated) {
+		p = strrchr(buf, '\n');
+		if (p) {
+			length = p - buf + 1;
+			buf[length] = 0;
+		}
+	}
+
+	for (p = buf; *p; p++) {
+		if (*p == '\n')
+			max_count++;
+	}
+
+	verdicts = kmalloc(max_count * sizeof(struct dazukofs_verdict),
+			   GFP_KERNEL);
+	if (!verdicts) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* one verdict per line */
+	cur = buf;
+	while ((line = strsep(&cur, "\n")) != NULL) {
+		p = strstr(line, "batch=");
+		if (p) {
+			ret = set_batch(gf, p + 6);
+			if (ret)
+				goto out_free;
+			continue;
+		}
+
+		p = strstr(line, "node=");
+		if (p) {
+			ret = set_node(gf, p + 5);
+			if (ret)
+				goto out_free;
+			continue;
+		}
+
+		p = strstr(line, "id=");
+		if (!p)
+			continue;
+		event_id = simple_strtoul(p + 3, &p2, 10);
+
+		p = strstr(p2, "r=");
+		if (!p) {
+			add_bad_id(gf, event_id);
+			continue;
+		}
+
+		verdicts[count].event_id = event_id;
+		if ((*(p + 2)) - '0' != 0)
+			verdicts[count].response = DENY;
+		else
+			verdicts[count].response = ALLOW;
+		count++;
+	}
+
+	ret = dazukofs_return_events(group_id, verdicts, count);
+	if (ret)
+		goto out_free;
+
+	for (i = 0; i < count; i++) {
+		if (verdicts[i].error)
+			add_bad_id(gf, verdicts[i].event_id);
+	}
+
+	ret = length;
+out_free:
+	kfree(verdicts);
+out:
+	kfree(buf);
+	return ret;
+}
+
+static ssize_t dazukofs_group_write(struct file *file,
 				    const char __user *buffer, size_t length,
 				    loff_t *pos)
 {
 #define DAZUKOFS_MAX_WRITE_BUFFER 19
+	struct dazukofs_group_file *gf = file->private_data;
+	int group_id = gf->group_id;
 	char tmp[DAZUKOFS_MAX_WRITE_BUFFER];
 	dazukofs_response_t response;
 	unsigned long event_id;
@@ -105,6 +787,10 @@ static ssize_t dazukofs_group_write(int group_id, struct file *file,
 	char *p2;
 	int ret;
 
+	/* batch mode does not require the file position to be reset */
+	if (gf->batch)
+		return dazukofs_group_write_batch(group_id, gf, buffer, length);
+
 	if (length >= DAZUKOFS_MAX_WRITE_BUFFER)
 		length = DAZUKOFS_MAX_WRITE_BUFFER - 1;
 
@@ -112,6 +798,36 @@ static ssize_t dazukofs_group_write(int group_id, struct file *file,
 		return -EFAULT;
 	tmp[length] = 0;
 
+	/* switch to ring mode */
+	p = strstr(tmp, "ring=");
+	if (p) {
+		ret = set_ring(gf, p + 5);
+		if (ret)
+			return ret;
+		*pos += length;
+		return length;
+	}
+
+	/* prefer events from a NUMA node */
+	p = strstr(tmp, "node=");
+	if (p) {
+		ret = set_node(gf, p + 5);
+		if (ret)
+			return ret;
+		*pos += length;
+		return length;
+	}
+
+	/* switch to batch mode */
+	p = strstr(tmp, "batch=");
+	if (p) {
+		ret = set_batch(gf, p + 6);
+		if (ret)
+			return ret;
+		*pos += length;
+		return length;
+	}
+
 	p = strstr(tmp, "id=");
 	if (!p)
 		return -EINVAL;
@@ -142,74 +858,129 @@ static ssize_t dazukofs_group_write(int group_id, struct file *file,
 	return ret;
 }
 
-static unsigned int dazukofs_group_poll(int group_id, struct file *file,
-					poll_table *wait)
+static unsigned int dazukofs_group_poll(struct file *file, poll_table *wait)
+{
+	struct dazukofs_group_file *gf = file->private_data;
+
+	return dazukofs_poll(gf->group_id, file, wait);
+}
+
+static int dazukofs_group_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct dazukofs_group_file *gf = file->private_data;
+	int err;
+
+	mutex_lock(&gf->ring_lock);
+	if (!gf->ring)
+		err = -ENODEV;
+	else if (vma->vm_end - vma->vm_start > gf->ring_size)
+		err = -EINVAL;
+	else
+		err = remap_vmalloc_range(vma, gf->ring, vma->vm_pgoff);
+	mutex_unlock(&gf->ring_lock);
+
+	return err;
+}
+
+static struct cdev groups_cdev;
+
+/* a single cdev serves all groups, the group id is the minor offset */
+static const struct file_operations group_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dazukofs_group_open,
+	.release	= dazukofs_group_release,
+	.read		= dazukofs_group_read,
+	.write		= dazukofs_group_write,
+	.poll		= dazukofs_group_poll,
+	.mmap		= dazukofs_group_mmap,
+};
+
+enum {
+	GROUP_STAT_TIMEOUTS,
+	GROUP_STAT_BYPASSED,
+	GROUP_STAT_BACKLOG,
+	GROUP_STAT_DEGRADED,
+	GROUP_STAT_EPOCH,
+};
+
+static ssize_t show_group_stat(struct device *dev, char *buf, int stat)
+{
+	int group_id = MINOR(dev->devt) - group_minor_start;
+	struct dazukofs_group_stats stats;
+	unsigned long value;
+
+	if (dazukofs_get_group_stats(group_id, &stats) != 0)
+		memset(&stats, 0, sizeof(stats));
+
+	switch (stat) {
+	case GROUP_STAT_TIMEOUTS:
+		value = stats.timeouts;
+		break;
+	case GROUP_STAT_BYPASSED:
+		value = stats.bypassed;
+		break;
+	case GROUP_STAT_BACKLOG:
+		value = stats.backlog;
+		break;
+	case GROUP_STAT_EPOCH:
+		value = stats.epoch;
+		break;
+	case GROUP_STAT_DEGRADED:
+	default:
+		value = stats.degraded;
+		break;
+	}
+
+	return sprintf(buf, "%lu\n", value);
+}
+
+static ssize_t timeouts_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
 {
-	return dazukofs_poll(group_id, file, wait);
+	return show_group_stat(dev, buf, GROUP_STAT_TIMEOUTS);
 }
 
-#define DECLARE_GROUP_FOPS(group_id) \
-static int \
-dazukofs_group_open_##group_id(struct inode *inode, struct file *file) \
-{ \
-	return dazukofs_group_open(group_id, inode, file); \
-} \
-static int \
-dazukofs_group_release_##group_id(struct inode *inode, struct file *file) \
-{ \
-	return dazukofs_group_release(group_id, inode, file); \
-} \
-static ssize_t \
-dazukofs_group_read_##group_id(struct file *file, char __user *buffer, \
-			       size_t length, loff_t *pos) \
-{ \
-	return dazukofs_group_read(group_id, file, buffer, length, pos); \
-} \
-static ssize_t \
-dazukofs_group_write_##group_id(struct file *file, \
-				const char __user *buffer, size_t length, \
-				loff_t *pos) \
-{ \
-	return dazukofs_group_write(group_id, file, buffer, length, pos); \
-} \
-static unsigned int \
-dazukofs_group_poll_##group_id(struct file *file, poll_table *wait) \
-{ \
-	return dazukofs_group_poll(group_id, file, wait); \
-} \
-static const struct file_operations group_fops_##group_id = { \
-	.owner		= THIS_MODULE, \
-	.open		= dazukofs_group_open_##group_id, \
-	.release	= dazukofs_group_release_##group_id, \
-	.read		= dazukofs_group_read_##group_id, \
-	.write		= dazukofs_group_write_##group_id, \
-	.poll		= dazukofs_group_poll_##group_id, \
+static ssize_t bypassed_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return show_group_stat(dev, buf, GROUP_STAT_BYPASSED);
+}
+
+static ssize_t backlog_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	return show_group_stat(dev, buf, GROUP_STAT_BACKLOG);
+}
+
+static ssize_t degraded_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return show_group_stat(dev, buf, GROUP_STAT_DEGRADED);
+}
+
+static ssize_t epoch_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	return show_group_stat(dev, buf, GROUP_STAT_EPOCH);
+}
+
+static DEVICE_ATTR(timeouts, S_IRUGO, timeouts_show, NULL);
+static DEVICE_ATTR(bypassed, S_IRUGO, bypassed_show, NULL);
+static DEVICE_ATTR(backlog, S_IRUGO, backlog_show, NULL);
+static DEVICE_ATTR(degraded, S_IRUGO, degraded_show, NULL);
+static DEVICE_ATTR(epoch, S_IRUGO, epoch_show, NULL);
+
+static struct attribute *group_dev_attrs[] = {
+	&dev_attr_timeouts.attr,
+	&dev_attr_bypassed.attr,
+	&dev_attr_backlog.attr,
+	&dev_attr_degraded.attr,
+	&dev_attr_epoch.attr,
+	NULL,
 };
 
-DECLARE_GROUP_FOPS(0)
-DECLARE_GROUP_FOPS(1)
-DECLARE_GROUP_FOPS(2)
-DECLARE_GROUP_FOPS(3)
-DECLARE_GROUP_FOPS(4)
-DECLARE_GROUP_FOPS(5)
-DECLARE_GROUP_FOPS(6)
-DECLARE_GROUP_FOPS(7)
-DECLARE_GROUP_FOPS(8)
-DECLARE_GROUP_FOPS(9)
-
-static struct cdev groups_cdev[GROUP_COUNT];
-
-static const struct file_operations *group_fops[GROUP_COUNT] = {
-	&group_fops_0,
-	&group_fops_1,
-	&group_fops_2,
-	&group_fops_3,
-	&group_fops_4,
-	&group_fops_5,
-	&group_fops_6,
-	&group_fops_7,
-	&group_fops_8,
-	&group_fops_9,
+static const struct attribute_group group_dev_attr_group = {
+	.attrs = group_dev_attrs,
 };
 
 int dazukofs_group_dev_init(int dev_major, int dev_minor_start,
@@ -218,22 +989,20 @@ int dazukofs_group_dev_init(int dev_major, int dev_minor_start,
 	int err;
 	struct device *dev;
 	int i;
-	int cdev_count;
 	int dev_minor_end = dev_minor_start;
 
-	/* setup cdevs for groups */
-	for (cdev_count = 0; cdev_count < GROUP_COUNT; cdev_count++) {
-		cdev_init(&groups_cdev[cdev_count], group_fops[cdev_count]);
-		groups_cdev[cdev_count].owner = THIS_MODULE;
-		err = cdev_add(&groups_cdev[cdev_count],
-			       MKDEV(dev_major, dev_minor_start + cdev_count),
-			       GROUP_COUNT);
-		if (err)
-			goto error_out1;
-	}
+	group_minor_start = dev_minor_start;
+
+	/* setup cdev for groups */
+	cdev_init(&groups_cdev, &group_fops);
+	groups_cdev.owner = THIS_MODULE;
+	err = cdev_add(&groups_cdev, MKDEV(dev_major, dev_minor_start),
+		       dazukofs_max_groups);
+	if (err)
+		goto error_out1;
 
 	/* create group devices */
-	for (i = 0; i < GROUP_COUNT; i++) {
+	for (i = 0; i < dazukofs_max_groups; i++) {
 		dev = device_create(dazukofs_class, NULL,
 				    MKDEV(dev_major, dev_minor_end), NULL,
 				    "%s.%d", DEVICE_NAME, i);
@@ -242,6 +1011,10 @@ int dazukofs_group_dev_init(int dev_major, int dev_minor_start,
 			goto error_out2;
 		}
 		dev_minor_end++;
+
+		err = sysfs_create_group(&dev->kobj, &group_dev_attr_group);
+		if (err)
+			goto error_out2;
 	}
 
 	return dev_minor_end;
@@ -249,9 +1022,8 @@ int dazukofs_group_dev_init(int dev_major, int dev_minor_start,
 error_out2:
 	for (i = dev_minor_start; i < dev_minor_end; i++)
 		device_destroy(dazukofs_class, MKDEV(dev_major, i));
+	cdev_del(&groups_cdev);
 error_out1:
-	for (i = 0; i < cdev_count; i++)
-		cdev_del(&groups_cdev[i]);
 	return err;
 }
 
@@ -264,6 +1036,5 @@ void dazukofs_group_dev_destroy(int dev_major, int dev_minor_start,
 	for (i = dev_minor_start; i < dev_minor_end; i++)
 		device_destroy(dazukofs_class, MKDEV(dev_major, i));
 
-	for (i = 0; i < GROUP_COUNT; i++)
-		cdev_del(&groups_cdev[i]);
+	cdev_del(&groups_cdev);
 }
@@ -30,6 +30,7 @@
 #include <linux/slab.h>
 
 #include "dazukofs_fs.h"
+#include "cache.h"
 
 static struct inode_operations dazukofs_symlink_iops;
 static struct inode_operations dazukofs_dir_iops;
@@ -543,6 +544,12 @@ static int dazukofs_setattr(struct dentry *dentry, struct iattr *ia)
 	err = notify_change(lower_dentry, ia);
 	mutex_unlock(&lower_inode->i_mutex);
 
+	/*
+	 * This also covers truncate, which changes the file contents. We
+	 * invalidate even on error since the change may be partial.
+	 */
+	dazukofs_cache_invalidate(inode);
+
 	fsstack_copy_attr_all(inode, lower_inode);
 	fsstack_copy_inode_size(inode, lower_inode);
 	return err;
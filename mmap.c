@@ -26,6 +26,7 @@
 #include <linux/pagemap.h>
 
 #include "dazukofs_fs.h"
+#include "cache.h"
 
 /**
  * Description: Called by the VM to read a page from backing store. The page
@@ -139,6 +140,7 @@ static int dazukofs_writepage(struct page *page, struct writeback_control *wbc)
 
 	/* Mark lower page dirty. Dont call lower writepage() yet. */
 	set_page_dirty(lower_page);
+	dazukofs_cache_invalidate(inode);
 	unlock_page(lower_page);
 	SetPageUptodate(page);
 fail:
@@ -0,0 +1,201 @@
+/* dazukofs: access control stackable filesystem
+
+   Copyright (C) 2008-2009 John Ogness
+     Author: John Ogness <dazukocode@ogness.net>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/pid.h>
+#include <linux/sched.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+
+#include "dev.h"
+#include "proc_dev.h"
+
+struct dazukofs_dev_proc {
+	struct hlist_node hash_node;
+	struct pid *proc_id;
+	struct dazukofs_proc_dev *pd;
+	struct rcu_head rcu;
+};
+
+static struct pid *current_proc_id(struct dazukofs_proc_dev *pd)
+{
+	return pd->by_tgid ? task_tgid(current) : task_pid(current);
+}
+
+static struct hlist_head *proc_hash_head(struct dazukofs_proc_dev *pd,
+					 struct pid *proc_id)
+{
+	return &pd->hash[hash_ptr(proc_id, PROC_DEV_HASH_BITS)];
+}
+
+/**
+ * dazukofs_proc_dev_check - check if current process is registered
+ * @pd: the device
+ *
+ * Description: The hash is read under RCU, so no lock is taken and no
+ * pid reference is acquired. If no process is registered, the hash is
+ * not looked at.
+ *
+ * Returns 0 if the current process is registered.
+ */
+int dazukofs_proc_dev_check(struct dazukofs_proc_dev *pd)
+{
+	struct dazukofs_dev_proc *proc;
+	struct hlist_node *pos;
+	struct pid *cur_proc_id;
+	int found = 0;
+
+	if (atomic_read(&pd->count) == 0)
+		return 1;
+
+	rcu_read_lock();
+	cur_proc_id = current_proc_id(pd);
+	hlist_for_each_entry_rcu(proc, pos, proc_hash_head(pd, cur_proc_id),
+				 hash_node) {
+		if (proc->proc_id == cur_proc_id) {
+			found = 1;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return !found;
+}
+
+static int dazukofs_proc_dev_open(struct inode *inode, struct file *file)
+{
+	struct dazukofs_proc_dev *pd =
+		container_of(inode->i_cdev, struct dazukofs_proc_dev, cdev);
+	struct dazukofs_dev_proc *proc =
+		kmem_cache_zalloc(pd->cachep, GFP_KERNEL);
+	if (!proc) {
+		file->private_data = NULL;
+		return -ENOMEM;
+	}
+
+	file->private_data = proc;
+	proc->proc_id = get_pid(current_proc_id(pd));
+	proc->pd = pd;
+
+	spin_lock(&pd->lock);
+	hlist_add_head_rcu(&proc->hash_node,
+			   proc_hash_head(pd, proc->proc_id));
+	atomic_inc(&pd->count);
+	spin_unlock(&pd->lock);
+
+	return 0;
+}
+
+static void dazukofs_free_proc(struct rcu_head *rcu)
+{
+	struct dazukofs_dev_proc *proc =
+		container_of(rcu, struct dazukofs_dev_proc, rcu);
+
+	put_pid(proc->proc_id);
+	kmem_cache_free(proc->pd->cachep, proc);
+}
+
+static int dazukofs_proc_dev_release(struct inode *inode, struct file *file)
+{
+	struct dazukofs_proc_dev *pd =
+		container_of(inode->i_cdev, struct dazukofs_proc_dev, cdev);
+	struct dazukofs_dev_proc *proc = file->private_data;
+
+	if (!proc)
+		return 0;
+
+	spin_lock(&pd->lock);
+	hlist_del_rcu(&proc->hash_node);
+	atomic_dec(&pd->count);
+	spin_unlock(&pd->lock);
+
+	file->private_data = NULL;
+
+	/* readers may still be looking at the structure */
+	call_rcu(&proc->rcu, dazukofs_free_proc);
+
+	return 0;
+}
+
+static const struct file_operations proc_dev_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dazukofs_proc_dev_open,
+	.release	= dazukofs_proc_dev_release,
+};
+
+int dazukofs_proc_dev_init(struct dazukofs_proc_dev *pd,
+			   int dev_major, int dev_minor,
+			   struct class *dazukofs_class)
+{
+	int err = 0;
+	struct device *dev;
+	int i;
+
+	for (i = 0; i < PROC_DEV_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&pd->hash[i]);
+	spin_lock_init(&pd->lock);
+	atomic_set(&pd->count, 0);
+
+	pd->cachep = kmem_cache_create(pd->cache_name,
+				       sizeof(struct dazukofs_dev_proc), 0,
+				       SLAB_HWCACHE_ALIGN, NULL);
+	if (!pd->cachep) {
+		err = -ENOMEM;
+		goto error_out1;
+	}
+
+	/* setup cdev */
+	cdev_init(&pd->cdev, &proc_dev_fops);
+	pd->cdev.owner = THIS_MODULE;
+	err = cdev_add(&pd->cdev, MKDEV(dev_major, dev_minor), 1);
+	if (err)
+		goto error_out2;
+
+	/* create device */
+	dev = device_create(dazukofs_class, NULL, MKDEV(dev_major, dev_minor),
+			    NULL, "%s.%s", DEVICE_NAME, pd->name);
+	if (IS_ERR(dev)) {
+		err = PTR_ERR(dev);
+		goto error_out3;
+	}
+
+	return 0;
+
+error_out3:
+	cdev_del(&pd->cdev);
+error_out2:
+	kmem_cache_destroy(pd->cachep);
+error_out1:
+	return err;
+}
+
+void dazukofs_proc_dev_destroy(struct dazukofs_proc_dev *pd,
+			       int dev_major, int dev_minor,
+			       struct class *dazukofs_class)
+{
+	device_destroy(dazukofs_class, MKDEV(dev_major, dev_minor));
+	cdev_del(&pd->cdev);
+
+	/* wait for all pending frees */
+	rcu_barrier();
+	kmem_cache_destroy(pd->cachep);
+}
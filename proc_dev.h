@@ -0,0 +1,65 @@
+/* dazukofs: access control stackable filesystem
+
+   Copyright (C) 2008-2009 John Ogness
+     Author: John Ogness <dazukocode@ogness.net>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#ifndef __PROC_DEV_H
+#define __PROC_DEV_H
+
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+
+/* registered processes are hashed by their pid structure */
+#define PROC_DEV_HASH_BITS	6
+#define PROC_DEV_HASH_SIZE	(1 << PROC_DEV_HASH_BITS)
+
+/*
+ * A device that registers the processes having it open. The ignore and
+ * async devices only differ in their name and whether the thread (pid) or
+ * the whole process (tgid) is registered.
+ */
+struct dazukofs_proc_dev {
+	const char *name;
+	const char *cache_name;
+	int by_tgid;
+
+	/* readers walk the hash with rcu_read_lock() */
+	struct hlist_head hash[PROC_DEV_HASH_SIZE];
+
+	/* protects: hash (writers) */
+	spinlock_t lock;
+
+	/* number of registered processes */
+	atomic_t count;
+
+	struct kmem_cache *cachep;
+	struct cdev cdev;
+};
+
+extern int dazukofs_proc_dev_init(struct dazukofs_proc_dev *pd,
+				  int dev_major, int dev_minor,
+				  struct class *dazukofs_class);
+extern void dazukofs_proc_dev_destroy(struct dazukofs_proc_dev *pd,
+				      int dev_major, int dev_minor,
+				      struct class *dazukofs_class);
+extern int dazukofs_proc_dev_check(struct dazukofs_proc_dev *pd);
+
+#endif /* __PROC_DEV_H */
@@ -30,6 +30,8 @@
 
 #include "dazukofs_fs.h"
 #include "dev.h"
+#include "event.h"
+#include "cache.h"
 
 static struct kmem_cache *dazukofs_inode_info_cachep;
 static struct kmem_cache *dazukofs_sb_info_cachep;
@@ -43,6 +45,8 @@ static struct inode *dazukofs_alloc_inode(struct super_block *sb)
 	if (!inodei)
 		return NULL;
 
+	dazukofs_cache_init_inode(&(inodei->vfs_inode));
+
 	/*
 	 * The inode is embedded within the dazukofs_inode_info struct.
 	 */
@@ -257,6 +261,7 @@ static void init_once(void *data)
 		(struct dazukofs_inode_info *)data;
 
 	memset(inode_info, 0, sizeof(struct dazukofs_inode_info));
+	spin_lock_init(&(inode_info->verdict_lock));
 	inode_init_once(&(inode_info->vfs_inode));
 }
 
@@ -324,15 +329,26 @@ out_nomem:
 	return -ENOMEM;
 }
 
+static void dazukofs_kill_sb(struct super_block *sb)
+{
+	/* files kept to be checked again hold inode references */
+	dazukofs_drop_hot_files(sb);
+
+	/*
+	 * Writeback may queue removals of stored verdicts, which hold
+	 * inode references until they are done.
+	 */
+	sync_filesystem(sb);
+	dazukofs_persist_flush();
+
+	kill_anon_super(sb);
+}
+
 static struct file_system_type dazukofs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "dazukofs",
 	.mount		= dazukofs_get_sb,
-	/*
-	 * XXX: We are using kill_anon_super() instead of my own function.
-	 *      Is this OK?
-	 */
-	.kill_sb	= kill_anon_super,
+	.kill_sb	= dazukofs_kill_sb,
 	.fs_flags	= 0,
 };
 
@@ -53,13 +53,48 @@ static int check_group_name(const char *gname)
 	return 0;
 }
 
+static char *read_groups(int fd)
+{
+	char *buf = NULL;
+	char *tmp;
+	size_t buflen = 0;
+	size_t size = 256;
+	ssize_t len;
+
+	for (;;) {
+		tmp = realloc(buf, size);
+		if (!tmp)
+			goto error_out;
+		buf = tmp;
+
+		len = read(fd, buf + buflen, size - buflen - 1);
+		if (len == -1)
+			goto error_out;
+		if (len == 0)
+			break;
+		buflen += len;
+
+		if (size - buflen - 1 == 0)
+			size *= 2;
+	}
+
+	buf[buflen] = 0;
+	return buf;
+
+error_out:
+	free(buf);
+	return NULL;
+}
+
 dazukofs_handle_t dazukofs_open(const char *gname, int flags)
 {
 	struct dazukofs_handle *hndl = NULL;
 	char key[25];
 	char buf[256];
+	char *groups = NULL;
 	char *p;
-	int gid;
+	char *end;
+	long gid;
 	int fd;
 
 	if (check_group_name(gname) != 0)
@@ -75,7 +110,9 @@ dazukofs_handle_t dazukofs_open(const char *gname, int flags)
 	} else {
 		memset(buf, 0, sizeof(buf));
 
-		if (flags & DAZUKOFS_TRACK_GROUP)
+		if (flags & DAZUKOFS_NOTIFY_GROUP)
+			snprintf(buf, sizeof(buf) - 1, "addnotify=%s", gname);
+		else if (flags & DAZUKOFS_TRACK_GROUP)
 			snprintf(buf, sizeof(buf) - 1, "addtrack=%s", gname);
 		else
 			snprintf(buf, sizeof(buf) - 1, "add=%s", gname);
@@ -86,20 +123,26 @@ dazukofs_handle_t dazukofs_open(const char *gname, int flags)
 		lseek(fd, 0, SEEK_SET);
 	}
 
-	memset(buf, 0, sizeof(buf));
-	if (read(fd, buf, sizeof(buf)-1) == -1)
+	groups = read_groups(fd);
+	if (!groups)
 		goto error_out_close;
 
 	memset(key, 0, sizeof(key));
 	snprintf(key, sizeof(key) - 1, ":%s\n", gname);
 
-	p = strstr(buf, key);
-	if (!p || p == buf)
+	/* each line has the form "<gid>:<name>\n" */
+	p = strstr(groups, key);
+	if (!p || p == groups)
+		goto error_out_close;
+
+	end = p;
+	while (p > groups && *(p - 1) != '\n')
+		p--;
+	if (p == end)
 		goto error_out_close;
 
-	p--;
-	gid = *p - '0';
-	if (gid < 0 || gid > 9)
+	gid = strtol(p, &end, 10);
+	if (*end != ':' || gid < 0)
 		goto error_out_close;
 
 	hndl = malloc(sizeof(struct dazukofs_handle));
@@ -112,13 +155,14 @@ dazukofs_handle_t dazukofs_open(const char *gname, int flags)
 		goto error_out_free;
 
 	memset(key, 0, sizeof(key));
-	snprintf(key, sizeof(key) - 1, "/dev/dazukofs.%d", gid);
+	snprintf(key, sizeof(key) - 1, "/dev/dazukofs.%ld", gid);
 
 	hndl->dev_fd = open(key, O_RDWR);
 	if (hndl->dev_fd == -1)
 		goto error_out_free;
 
 	close(fd);
+	free(groups);
 
 	return hndl;
 
@@ -129,6 +173,7 @@ error_out_free:
 	hndl = NULL;
 error_out_close:
 	close(fd);
+	free(groups);
 error_out:
 	return hndl;
 }
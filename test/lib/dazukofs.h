@@ -25,6 +25,7 @@
 
 /* dazukofs_open() flags */
 #define DAZUKOFS_TRACK_GROUP 1
+#define DAZUKOFS_NOTIFY_GROUP 2
 
 /* dazukofs_close() flags */
 #define DAZUKOFS_REMOVE_GROUP 1